@@ -35,7 +35,9 @@ typedef enum Opcode {
 	OP_EQJ, OP_LTJ, OP_GTJ,
 	OP_EQC, OP_LTC, OP_GTC,
 	OP_ARG, OP_JMP, OP_CJ, OP_CALL, OP_CC, OP_RET, OP_RETV,
-	OP_SYS,
+	OP_SYS, OP_CALLF, OP_RETF,
+	OP_EXT, OP_ARGN, OP_LDX, OP_STX,
+	OP_SHL, OP_SHR, OP_ROL, OP_ROR,
 	OP_COUNT
 } Opcode;
 
@@ -52,7 +54,9 @@ const char *opnames[] = {
 	"eqj", "ltj", "gtj",
 	"eqc", "ltc", "gtc",
 	"arg", "jmp", "cj", "call", "cc", "ret", "retv",
-	"sys"
+	"sys", "callf", "retf",
+	"ext", "argn", "ldx", "stx",
+	"shl", "shr", "rol", "ror"
 };
 
 mpc_parser_t *program;
@@ -66,6 +70,13 @@ mpc_ast_t **files = NULL;
 u16 lastins = 0;  // starting address of current instruction
 u8 argcount = 0;  // arguments that have been assembled of the current instruction so far
 
+struct {char *key; bool value;} *leaves = NULL;  // functions called with callf, see scan()
+bool leafnext = false;  // the next block is a leaf function
+bool inleaf = false;    // inside a leaf function, ret is assembled as retf
+
+mpc_ast_t *stmts = NULL;  // statement list of the statement being assembled, see reshdead()
+int stmt = 0;             // index of the statement being assembled in stmts
+
 // _____________________________________________________________________________
 //
 //  Utilities
@@ -102,6 +113,7 @@ void push16(mpc_ast_t *t, u16 addr) {
 }
 
 void assemble(char *filename, bool ismain);
+u8 eval_reg(mpc_ast_t *t);
 
 // _____________________________________________________________________________
 //
@@ -113,6 +125,9 @@ u16 eval_number(mpc_ast_t *t, VarType type) {
 		output[lastins] = output[lastins] | (0b10000000 >> argcount);
 		return eval_number(t->children[1], VAR_REGISTER);
 	}
+	if (strstr(t->tag, "regnum")) {
+		return eval_reg(t->children[1]);
+	}
 	if (strstr(t->tag, "val_lohi")) {
 		u16 addr = eval_number(t->children[2], VAR_ADDRESS);
 		if (!strcmp(t->children[0]->contents, "lo")) {
@@ -219,6 +234,368 @@ u8 eval_reg(mpc_ast_t *t) {
 	}
 }
 
+// _____________________________________________________________________________
+//
+//  Leaf Functions
+// _____________________________________________________________________________
+//
+// Before assembling, scan() goes through the whole program looking for leaf
+// functions: a label followed by a { } block that doesn't use the locals
+// (%40-%47, by number or by a name from vars or reg), no calls and no retv, so
+// it doesn't need the locals saved. Register names are global, so a function
+// can use a local through a name that another function declared with vars. These are called with
+// callf and return with retf, which only save the arguments and the return
+// address.
+//
+// The two kinds of calls can't be mixed, so a function is only a leaf if:
+// - the function's label is only used by call instructions
+// - the block only jumps to its own labels, and its labels are only used by
+//   itself
+// - execution can't fall into or out of the block, the instructions before it
+//   and at its end are jmp, ret or retv
+// - the labels are only defined once
+//
+typedef enum RefType {
+	REF_CALL,   // the address of a call instruction
+	REF_JUMP,   // the address of a jump instruction
+	REF_OTHER   // anything else, such as hi(), lo() or datl
+} RefType;
+
+typedef struct Ref {
+	char *name;
+	RefType type;
+	int func;    // function that uses the label, -1 if none
+} Ref;
+
+typedef struct Func {
+	char *name;
+	bool leaf;
+} Func;
+
+typedef struct Label {
+	int defs;  // times the label is defined
+	int func;  // function that the label is in, -1 if none
+} Label;
+
+// reg name target, where target is a register name
+typedef struct Alias {
+	char *name;
+	char *target;
+} Alias;
+
+Func *funcs = NULL;
+Ref *refs = NULL;
+struct {char *key; Label value;} *labels = NULL;
+
+Ref *regrefs = NULL;                       // register names used in functions
+Alias *aliases = NULL;
+struct {char *key; bool value;} *locals = NULL;  // register names that can be a local
+
+int curfunc = -1;               // function being scanned
+const char *lastop = NULL;      // name of the previous instruction
+mpc_ast_t **scanned = NULL;     // parse results, deleted after scanning
+
+mpc_ast_t *parse(char *filename) {
+	mpc_result_t res;
+	if (!mpc_parse_contents(filename, program, &res)) {
+		mpc_err_print(res.error);
+		mpc_err_delete(res.error);
+		exit(EXIT_FAILURE);
+	}
+	return res.output;
+}
+
+void scanfile(char *filename);
+
+// Add every identifier in t as a reference
+void scanrefs(mpc_ast_t *t, RefType type) {
+	if (strstr(t->tag, "ident")) {
+		arrput(refs, ((Ref) {t->contents, type, curfunc}));
+	}
+	for (int i = 0; i < t->children_num; i++) scanrefs(t->children[i], type);
+}
+
+// Whether a register number is a local. Invalid numbers are reported when
+// assembling.
+bool islocal(mpc_ast_t *num) {
+	unsigned long reg;
+	if (num->children_num == 2) {
+		int base = !strcmp(num->children[0]->contents, "0x") ? 16 : 2;
+		reg = strtoul(num->children[1]->contents, NULL, base);
+	} else {
+		reg = strtoul(num->contents, NULL, 10);
+	}
+	return reg >= 0x28 && reg <= 0x2F;
+}
+
+// Check the registers that t uses, directly, as a pointer or by number (%name).
+// Numbered locals make the function not a leaf right away, names are checked
+// by scan() once all of them are known.
+void scanregs(mpc_ast_t *t) {
+	if (strstr(t->tag, "register") || strstr(t->tag, "regnum")) {
+		mpc_ast_t *r = t->children_num ? t->children[1] : t;
+		if (strstr(r->tag, "ident")) {
+			arrput(regrefs, ((Ref) {r->contents, REF_OTHER, curfunc}));
+		}
+		else if (islocal(r)) {
+			funcs[curfunc].leaf = false;
+		}
+		return;
+	}
+	for (int i = 0; i < t->children_num; i++) scanregs(t->children[i]);
+}
+
+bool isjump(const char *op) {
+	return !strcmp(op, "jmp") || !strcmp(op, "cj") || !strcmp(op, "eqj") ||
+		!strcmp(op, "ltj") || !strcmp(op, "gtj");
+}
+
+bool iscall(const char *op) {
+	return !strcmp(op, "call") || !strcmp(op, "callf") || !strcmp(op, "cc") ||
+		!strcmp(op, "eqc") || !strcmp(op, "ltc") || !strcmp(op, "gtc");
+}
+
+bool isexit(const char *op) {
+	return op && (
+		!strcmp(op, "jmp") || !strcmp(op, "ret") || !strcmp(op, "retv") ||
+		!strcmp(op, "retf")
+	);
+}
+
+// Scan the statements children[start] to children[end - 1] of t
+void scanstmts(mpc_ast_t *t, int start, int end) {
+	for (int i = start; i < end; i++) {
+		mpc_ast_t *c = t->children[i];
+
+		if (strstr(c->tag, "label")) {
+			char *name = c->children[0]->contents;
+
+			// Is the label followed by a block
+			int next = i + 1;
+			while (next < end && strstr(t->children[next]->tag, "comment")) next++;
+			bool func = curfunc == -1 && next < end && strstr(t->children[next]->tag, "block");
+
+			if (func) {
+				arrput(funcs, ((Func) {name, isexit(lastop)}));
+				curfunc = arrlen(funcs) - 1;
+			} else {
+				// Code can be jumped to here
+				lastop = NULL;
+			}
+
+			Label label = shget(labels, name);
+			if (label.defs && label.func != -1) funcs[label.func].leaf = false;
+			label.defs++;
+			label.func = curfunc;
+			shput(labels, name, label);
+
+			if (func) {
+				mpc_ast_t *block = t->children[next];
+				scanstmts(block, 1, block->children_num - 1);
+
+				if (!isexit(lastop)) funcs[curfunc].leaf = false;
+				curfunc = -1;
+				i = next;
+			}
+		}
+		else if (strstr(c->tag, "block")) {
+			scanstmts(c, 1, c->children_num - 1);
+		}
+		else if (strstr(c->tag, "instruction|regex")) {
+			lastop = c->contents;
+		}
+		else if (strstr(c->tag, "instruction")) {
+			const char *op = c->children[0]->contents;
+			lastop = op;
+
+			// retv has no fast version
+			if (curfunc != -1 && (iscall(op) || !strcmp(op, "retv"))) funcs[curfunc].leaf = false;
+
+			for (int j = 1; j < c->children_num; j++) {
+				mpc_ast_t *a = c->children[j];
+				bool last = j == c->children_num - 1;
+
+				if (last && isjump(op)) {
+					if (curfunc != -1 && !strstr(a->tag, "ident")) funcs[curfunc].leaf = false;
+					scanrefs(a, REF_JUMP);
+				}
+				else if (last && !strcmp(op, "call") && strstr(a->tag, "ident")) {
+					scanrefs(a, REF_CALL);
+				}
+				else {
+					scanrefs(a, REF_OTHER);
+				}
+				if (curfunc != -1) scanregs(a);
+			}
+		}
+		else if (strstr(c->tag, "ins_vars")) {
+			if (curfunc != -1) funcs[curfunc].leaf = false;
+			for (int j = 1; j < c->children_num; j += 2) {
+				shput(locals, c->children[j]->contents, true);
+			}
+		}
+		else if (strstr(c->tag, "ins_reg")) {
+			char *name = c->children[1]->contents;
+			mpc_ast_t *r = c->children[2];
+
+			if (!r->children_num) arrput(aliases, ((Alias) {name, r->contents}));
+			else if (islocal(r->children[1])) shput(locals, name, true);
+		}
+		else if (strstr(c->tag, "ins_dat")) {
+			lastop = NULL;
+			scanrefs(c, REF_OTHER);
+		}
+		else if (strstr(c->tag, "ins_addr")) {
+			scanrefs(c->children[2], REF_OTHER);
+		}
+		else if (strstr(c->tag, "include")) {
+			char *filename = NULL;
+			for (size_t j = 1; j < strlen(c->children[1]->contents) - 1; j++) {
+				arrput(filename, c->children[1]->contents[j]);
+			}
+			arrput(filename, 0);
+			scanfile(filename);
+			arrfree(filename);
+		}
+	}
+}
+
+void scanfile(char *filename) {
+	mpc_ast_t *t = parse(filename);
+	arrput(scanned, t);
+	scanstmts(t, 0, t->children_num);
+}
+
+// Find the leaf functions of the program starting at filename
+void scan(char *filename) {
+	scanfile(filename);
+
+	for (int i = 0; i < arrlen(refs); i++) {
+		Ref ref = refs[i];
+		if (shgeti(labels, ref.name) == -1) {
+			// Not a label, only matters for jumps
+			if (ref.type == REF_JUMP && ref.func != -1) funcs[ref.func].leaf = false;
+			continue;
+		}
+		Label label = shget(labels, ref.name);
+
+		// Jumps out of a function
+		if (ref.type == REF_JUMP && ref.func != -1 && ref.func != label.func) {
+			funcs[ref.func].leaf = false;
+		}
+
+		// Other uses of a function's labels, calls to its start are fine
+		if (label.func != -1 && ref.func != label.func) {
+			bool start = !strcmp(funcs[label.func].name, ref.name);
+			if (!start || ref.type != REF_CALL) funcs[label.func].leaf = false;
+		}
+	}
+
+	for (int i = 0; i < shlen(labels); i++) {
+		if (labels[i].value.defs > 1 && labels[i].value.func != -1) {
+			funcs[labels[i].value.func].leaf = false;
+		}
+	}
+
+	// Names given to a local through other names
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (int i = 0; i < arrlen(aliases); i++) {
+			if (shgeti(locals, aliases[i].target) != -1 && shgeti(locals, aliases[i].name) == -1) {
+				shput(locals, aliases[i].name, true);
+				changed = true;
+			}
+		}
+	}
+
+	for (int i = 0; i < arrlen(regrefs); i++) {
+		if (shgeti(locals, regrefs[i].name) != -1) funcs[regrefs[i].func].leaf = false;
+	}
+
+	for (int i = 0; i < arrlen(funcs); i++) {
+		if (funcs[i].leaf) shput(leaves, funcs[i].name, true);
+	}
+}
+
+// _____________________________________________________________________________
+//
+//  Strength Reduction
+// _____________________________________________________________________________
+//
+// mul, div and mod by a power of two are assembled as shl, shr and and, which
+// are cheaper for the VM. mul and shl set resH the same way and and leaves it
+// alone like mod, but div leaves resH alone while shr sets it, so div is only
+// changed if the following instructions overwrite resH before reading it.
+//
+// Whether an operand is resH or a register that could read it through a
+// pointer. Registers that aren't defined yet count as resH.
+bool usesresh(mpc_ast_t *t) {
+	if (strstr(t->tag, "val_reg")) t = t->children[1];
+	else if (!strstr(t->tag, "register")) return false;
+
+	if (strstr(t->tag, "ident")) {
+		if (shgeti(vars, t->contents) == -1) return true;
+		Variable var = shget(vars, t->contents);
+		return var.type != VAR_REGISTER || var.value >= 62;
+	}
+	if (t->children[1]->children_num) return true;
+	return strtoul(t->children[1]->contents, NULL, 10) >= 62;
+}
+
+// Whether resH is written before it's read after the current statement. Only
+// looks at the straight line of instructions that follows it, labels, blocks
+// and control flow end the search.
+bool reshdead(void) {
+	for (int i = stmt + 1; i < stmts->children_num; i++) {
+		mpc_ast_t *t = stmts->children[i];
+
+		if (strstr(t->tag, "comment") || strstr(t->tag, "ins_")) {
+			if (strstr(t->tag, "ins_dat")) return false;
+			continue;
+		}
+		if (!strstr(t->tag, "instruction") || !t->children_num) return false;
+
+		for (int j = 1; j < t->children_num; j++) {
+			if (usesresh(t->children[j])) return false;
+		}
+
+		const char *op = t->children[0]->contents;
+		if (!strcmp(op, "add") || !strcmp(op, "sub") || !strcmp(op, "mul")) return true;
+
+		static const char *keeps[] = {
+			"set", "ld", "st", "div", "mod", "and", "or", "xor", "eq", "lt", "gt", "arg"
+		};
+		bool keep = false;
+		for (size_t j = 0; j < sizeof(keeps)/sizeof(keeps[0]); j++) {
+			if (!strcmp(op, keeps[j])) keep = true;
+		}
+		if (!keep) return false;
+	}
+	return false;
+}
+
+// Get the instruction to assemble instead of op, and set *imm to its second
+// operand. Returns op if it can't be reduced.
+const char *reduce(mpc_ast_t *t, const char *op, int *imm) {
+	bool mul = !strcmp(op, "mul");
+	bool div = !strcmp(op, "div");
+	bool mod = !strcmp(op, "mod");
+	if (!mul && !div && !mod) return op;
+
+	mpc_ast_t *c = t->children[2];
+	if (!strstr(c->tag, "number") && !strstr(c->tag, "ident")) return op;
+
+	u16 val = eval_number(c, VAR_VALUE);
+	if (!val || (val & (val - 1))) return op;
+	if (div && !reshdead()) return op;
+
+	int shift = 0;
+	while (val >> shift != 1) shift++;
+
+	*imm = mod ? val - 1 : shift;
+	return mul ? "shl" : div ? "shr" : "and";
+}
+
 // _____________________________________________________________________________
 //
 //  Evaluation
@@ -230,26 +607,42 @@ void eval(mpc_ast_t *t) {
 
 	if (!strcmp(t->tag, ">")) {
 		for (int i = 0; i < t->children_num; i++) {
+			stmts = t;
+			stmt = i;
 			eval(t->children[i]);
 		}
 	}
 
-	TAG("label") shput(
-		vars, t->children[0]->contents,
-		((Variable) {VAR_ADDRESS, arrlen(output)})
-	);
+	TAG("label") {
+		shput(
+			vars, t->children[0]->contents,
+			((Variable) {VAR_ADDRESS, arrlen(output)})
+		);
+		leafnext = shgeti(leaves, t->children[0]->contents) != -1;
+	}
 
 	TAG("block") {
+		bool outer = inleaf;
+		inleaf = inleaf || leafnext;
+		leafnext = false;
+
 		for (int i = 1; i < t->children_num - 1; i++) {
+			stmts = t;
+			stmt = i;
 			eval(t->children[i]);
 		}
+		inleaf = outer;
 	}
 
 	// Instruction which doesn't take any args
 	TAG("instruction|regex") {
-		for (int i = 0; i < OP_COUNT; i++) {
-			if (!strcmp(opnames[i], t->contents)) {
-				push(t, i); break;
+		if (inleaf && !strcmp(t->contents, "ret")) {
+			push(t, OP_RETF);
+		} else {
+			for (int i = 0; i < OP_COUNT; i++) {
+				if (!strcmp(opnames[i], t->contents)) {
+					push(t, i); break;
+				}
 			}
 		}
 		ENDINS();
@@ -257,21 +650,71 @@ void eval(mpc_ast_t *t) {
 
 	TAG("instruction") {
 		if (!strcmp(t->children[0]->contents, "arg")) {
-			for (int i = 1; i < t->children_num; i += 2) {
-				push(t->children[i], OP_ARG);
-				push(t->children[i], eval_number(t->children[i], VAR_VALUE));
-				ENDINS();
+			if (t->children_num == 2) {
+				push(t->children[1], OP_ARG);
+				push(t->children[1], eval_number(t->children[1], VAR_VALUE));
+			} else {
+				// Multiple values are packed into argn instructions of up to 8
+				// values: the count - 1 in the pointer flags, the extended
+				// opcode, a pointer flag for each value and the values
+				for (int i = 1; i < t->children_num; i += 16) {
+					int count = (t->children_num - i + 1)/2;
+					if (count > 8) count = 8;
+
+					push(t->children[i], OP_EXT | (count - 1) << 5);
+					push(t->children[i], OP_ARGN - OP_EXT - 1);
+					push(t->children[i], 0);
+					u16 flags = arrlen(output) - 1;
+
+					for (int j = 0; j < count; j++) {
+						mpc_ast_t *c = t->children[i + j*2];
+
+						if (strstr(c->tag, "val_reg")) {
+							output[flags] |= 0b10000000 >> j;
+							push(c, eval_number(c->children[1], VAR_REGISTER));
+						} else {
+							push(c, eval_number(c, VAR_VALUE));
+						}
+					}
+					ENDINS();
+				}
 			}
 		} else {
+			const char *op = t->children[0]->contents;
+			if (
+				!strcmp(op, "call") && strstr(t->children[1]->tag, "ident") &&
+				shgeti(leaves, t->children[1]->contents) != -1
+			) op = "callf";
+
+			// ld/st with an offset register: ldx/stx, an extended opcode. The
+			// third pointer flag is set for a post-increment (++).
+			u8 flags = 0;
+			if (t->children_num > 3 && (!strcmp(op, "ld") || !strcmp(op, "st"))) {
+				bool inc = !strcmp(t->children[t->children_num - 1]->contents, "++");
+				if (inc) flags = 0b00100000;
+				op = !strcmp(op, "ld") ? "ldx" : "stx";
+			}
+
+			int imm = -1;  // replaces the second operand, see reduce()
+			op = reduce(t, op, &imm);
+
 			for (int i = 0; i < OP_COUNT; i++) {
-				if (!strcmp(opnames[i], t->children[0]->contents)) {
-					push(t->children[0], i); break;
+				if (!strcmp(opnames[i], op)) {
+					if (i > OP_EXT) {
+						push(t->children[0], OP_EXT | flags);
+						push(t->children[0], i - OP_EXT - 1);
+					}
+					else push(t->children[0], i);
+					break;
 				}
 			}
 
 			for (int i = 1; i < t->children_num; i++) {
 				mpc_ast_t *c = t->children[i];
-				if (strstr(c->tag, "val_reg")) {
+				if (i == 2 && imm >= 0) {
+					push(c, imm);
+				}
+				else if (strstr(c->tag, "val_reg")) {
 					push(c, eval_number(c, VAR_VALUE));
 				}
 				else if (strstr(c->tag, "register")) {
@@ -393,15 +836,9 @@ void eval(mpc_ast_t *t) {
 void assemble(char *filename, bool ismain) {
 	arrput(filenames, filename);
 
-	mpc_result_t res;
-	if (!mpc_parse_contents(filename, program, &res)) {
-		mpc_err_print(res.error);
-		mpc_err_delete(res.error);
-		exit(EXIT_FAILURE);
-	}
-
-	arrput(files, res.output);
-	eval(res.output);
+	mpc_ast_t *t = parse(filename);
+	arrput(files, t);
+	eval(t);
 
 	if (ismain) {
 		// Check forward references
@@ -438,11 +875,20 @@ void assemble(char *filename, bool ismain) {
 //
 void cleanup(void) {
 	for (int i = 0; i < arrlen(files); i++) mpc_ast_delete(files[i]);
+	for (int i = 0; i < arrlen(scanned); i++) mpc_ast_delete(scanned[i]);
 	arrfree(output);
 	shfree(vars);
 	hmfree(forwardrefs);
 	arrfree(filenames);
 	arrfree(files);
+	arrfree(scanned);
+	arrfree(funcs);
+	arrfree(refs);
+	shfree(labels);
+	arrfree(regrefs);
+	arrfree(aliases);
+	shfree(locals);
+	shfree(leaves);
 	mpc_cleanup(1, program);
 }
 
@@ -520,6 +966,7 @@ int main(int argc, char **argv) {
 	DEFTAG(value);
 	DEFTAG(val_reg);
 	DEFTAG(val_lohi);
+	DEFTAG(regnum);
 	DEFTAG(address);
 
 // _____________________________________________________________________________
@@ -542,7 +989,9 @@ int main(int argc, char **argv) {
 			instruction: \n \
 			  /nop\\b/ \n \
 			| /set\\b/ <register> <value> \n \
+			| /ld\\b/ <register> <address> '+' <register> \"++\"? \n \
 			| /ld\\b/ <register> <address> \n \
+			| /st\\b/ <register> <address> '+' <register> \"++\"? \n \
 			| /st\\b/ <register> <address> \n \
 			| /add\\b/ <value> <value> <register> \n \
 			| /sub\\b/ <value> <value> <register> \n \
@@ -568,7 +1017,13 @@ int main(int argc, char **argv) {
 			| /cc\\b/ <register> <address> \n \
 			| /retv\\b/ <value> \n \
 			| /ret\\b/ \n \
-			| /sys\\b/ <value>; \n \
+			| /sys\\b/ <value> \n \
+			| /callf\\b/ <address> \n \
+			| /retf\\b/ \n \
+			| /shl\\b/ <value> <value> <register> \n \
+			| /shr\\b/ <value> <value> <register> \n \
+			| /rol\\b/ <value> <value> <register> \n \
+			| /ror\\b/ <value> <value> <register>; \n \
 			\n \
 			ins_dat: /dat\\b/ <data> (',' <data>)*; \n \
 			ins_datl: /datl\\b/ <address> (',' <address>)*; \n \
@@ -587,15 +1042,16 @@ int main(int argc, char **argv) {
 			\n \
 			register: '%' <number> | <ident>; \n \
 			\n \
-			value: <number> | <val_reg> | <val_lohi> | <ident>; \n \
+			value: <number> | <val_reg> | <val_lohi> | <regnum> | <ident>; \n \
 			val_reg: '[' <register> ']'; \n \
 			val_lohi: /lo|hi/ '(' <address> ')'; \n \
+			regnum: '%' <ident>; \n \
 			address: <number> | <ident> | <val_reg>; \n \
 			\
 		",
 		program, stmt, comment, label, block, instruction,
 		ins_dat, ins_datl, ins_val, ins_addr, ins_reg, ins_args, ins_vars, include,
-		data, string, number, ident, reg, value, val_reg, val_lohi, address
+		data, string, number, ident, reg, value, val_reg, val_lohi, regnum, address
 	);
 
 	if (e != NULL) {
@@ -607,6 +1063,7 @@ int main(int argc, char **argv) {
 	arrput(output, 'G');
 	arrput(output, 'X');
 	arrput(output, 'A');
+	scan(mainfile);
 	assemble(mainfile, true);
 
 // _____________________________________________________________________________
@@ -615,9 +1072,9 @@ int main(int argc, char **argv) {
 // _____________________________________________________________________________
 //
 	mpc_cleanup(
-		22, stmt, comment, label, block, instruction,
+		23, stmt, comment, label, block, instruction,
 		ins_dat, ins_datl, ins_val, ins_addr, ins_reg, ins_args, ins_vars, include,
-		data, string, number, ident, reg, value, val_reg, val_lohi, address
+		data, string, number, ident, reg, value, val_reg, val_lohi, regnum, address
 	);
 
 	char *outname = TextReplace(mainfile, ".gxs", ".gxa");
@@ -0,0 +1,71 @@
+#!/bin/bash
+# ______________________________________________________________________________
+#
+#  Build options for libgxvm, the gxarch VM core as a static library
+#  libgxvm doesn't depend on raylib, so it can be used for headless programs.
+# ______________________________________________________________________________
+#
+# Library name, extension is added depending on target platform.
+NAME=libgxvm
+
+# Files to compile. You can add multiple files by separating by spaces.
+SRC="src/vm.c src/run.c src/jit.c src/recomp.c src/render.c"
+
+# Platform, one of Windows_NT, Linux. Defaults to your OS.
+# This can be set from the command line: TARGET=Windows_NT ./build_lib.sh
+[[ -z "$TARGET" ]] && TARGET=$(uname)
+
+# Compiler flags.
+# This can be set from the command line: FLAGS="-Ofast" ./build_lib.sh
+[[ -z "$FLAGS" ]] && FLAGS=""
+
+# Compiler flags for release and debug mode
+# To set debug mode, run: DEBUG=1 ./build_lib.sh
+RELEASE_FLAGS="-O2"
+DEBUG_FLAGS="-DDEBUG -O0 -g -Wall -Wextra -Wpedantic"
+
+# ______________________________________________________________________________
+#
+#  Compile libgxvm
+# ______________________________________________________________________________
+#
+# Add release or debug flags
+if [[ -z "$DEBUG" ]]; then
+	FLAGS="$FLAGS $RELEASE_FLAGS"
+else
+	FLAGS="$FLAGS $DEBUG_FLAGS"
+fi
+
+# Build options for each target
+case "$TARGET" in
+	"Windows_NT")
+		# To build for 32-bit, set ARCH to i686
+		ARCH="x86_64"
+		CC="$ARCH-w64-mingw32-gcc"
+		AR="$ARCH-w64-mingw32-ar"
+		;;
+
+	"Linux")
+		CC="gcc"
+		AR="ar"
+		;;
+
+	*)
+		echo "Unsupported platform $TARGET"
+		exit 1
+		;;
+esac
+
+# Stop the build process if anything fails
+set -e
+
+mkdir --parents lib/$TARGET/gxvm
+OBJS=""
+
+for file in $SRC; do
+	obj="lib/$TARGET/gxvm/$(basename ${file%.c}).o"
+	$CC -c $file -Isrc -o $obj $FLAGS
+	OBJS="$OBJS $obj"
+done
+
+$AR rcs lib/$TARGET/$NAME.a $OBJS
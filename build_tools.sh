@@ -0,0 +1,70 @@
+#!/bin/bash
+# ______________________________________________________________________________
+#
+#  Build options for gxarch tools
+#  The tools use the VM core (src/vm.c) but not raylib.
+# ______________________________________________________________________________
+#
+# Tools to build, each one is compiled from tools/<name>.c
+TOOLS="gxtrace gxbench gxrecomp"
+
+# Files to compile into every tool. You can add multiple files by separating by spaces.
+SRC="src/vm.c src/run.c src/jit.c src/recomp.c src/render.c"
+
+# ROM recompiled to C with gxrecomp, built into gxbench to measure it.
+# This can be set from the command line: RECOMP=game.c ./build_tools.sh
+[[ -z "$RECOMP" ]] && RECOMP=""
+
+# Platform, one of Windows_NT, Linux. Defaults to your OS.
+# This can be set from the command line: TARGET=Windows_NT ./build_tools.sh
+[[ -z "$TARGET" ]] && TARGET=$(uname)
+
+# Compiler flags.
+# This can be set from the command line: FLAGS="-Ofast" ./build_tools.sh
+[[ -z "$FLAGS" ]] && FLAGS=""
+
+# Compiler flags for release and debug mode
+# To set debug mode, run: DEBUG=1 ./build_tools.sh
+RELEASE_FLAGS="-O2 -s"
+DEBUG_FLAGS="-DDEBUG -O0 -g -Wall -Wextra -Wpedantic"
+
+# ______________________________________________________________________________
+#
+#  Compile tools
+# ______________________________________________________________________________
+#
+# Add release or debug flags
+if [[ -z "$DEBUG" ]]; then
+	FLAGS="$FLAGS $RELEASE_FLAGS"
+else
+	FLAGS="$FLAGS $DEBUG_FLAGS"
+fi
+
+# Build options for each target
+case "$TARGET" in
+	"Windows_NT")
+		# To build for 32-bit, set ARCH to i686
+		ARCH="x86_64"
+		CC="$ARCH-w64-mingw32-gcc"
+		EXT=".exe"
+		;;
+
+	"Linux")
+		CC="gcc"
+		TARGET_FLAGS="-lm"
+		;;
+
+	*)
+		echo "Unsupported platform $TARGET"
+		exit 1
+		;;
+esac
+
+# Stop the build process if anything fails
+set -e
+
+for tool in $TOOLS; do
+	EXTRA=""
+	[[ "$tool" = "gxbench" && -n "$RECOMP" ]] && EXTRA="$RECOMP -DRECOMP"
+	$CC tools/$tool.c $SRC $EXTRA -Isrc -o $tool$EXT $FLAGS $TARGET_FLAGS
+done
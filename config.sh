@@ -9,7 +9,14 @@
 NAME=gxvm
 
 # Files to compile. You can add multiple files by separating by spaces.
-SRC="src/main.c src/rfxgen.c src/sram.c src/ui.c src/vm.c"
+SRC="src/main.c src/render.c src/rfxgen.c src/jit.c src/recomp.c src/run.c src/sram.c src/ui.c src/vm.c"
+
+# ROM recompiled to C with gxrecomp, it's run natively when that ROM is loaded.
+# This can be set from the command line: RECOMP=game.c ./build.sh
+if [[ -n "$RECOMP" ]]; then
+	SRC="$SRC $RECOMP"
+	FLAGS="$FLAGS -DRECOMP"
+fi
 
 # Platform, one of Windows_NT, Linux, Web. Defaults to your OS.
 # This can be set from the command line: TARGET=Web ./build.sh
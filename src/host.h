@@ -0,0 +1,55 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include "raylib.h"
+#include "vm.h"
+#include "render.h"
+
+// One SYS_DRAW call, or a SYS_CLEAR if fill is set: then sx and sy are the
+// clearX/clearY pixel it fills with
+typedef struct DrawCall {
+	bool fill;
+	u8 sx, sy, w, h, x, y;
+} DrawCall;
+
+// Everything a frame draws: the background pixel (clearX and clearY when the
+// frame started, unused if keep is set), the tilemap if there is one, the
+// SYS_DRAW/SYS_CLEAR calls in order and the sprites. With keep they are drawn
+// over the previous frame.
+typedef struct DrawList {
+	bool keep;
+	u8 clearX, clearY;
+	bool map;
+	MapView view;
+	Sprite sprites[MAX_SPRITES];
+	int spriteCount;
+	DrawCall *calls;
+	int count;
+	int size;
+	uint64_t hash;
+} DrawList;
+
+// State of the raylib frontend, given to the VM callbacks as user data.
+typedef struct Host {
+	int scale;
+	Texture tileset;
+	RenderTexture screen;
+	RenderTexture canvas;  // what the ROM has drawn, screen has messages on top of it
+	Render *render;   // software renderer, NULL when drawing with the GPU
+	Texture frame;    // the software renderer's screen, used instead of canvas
+
+	// The frame being run and the last finished one, which is on the screen.
+	// The screen is only drawn again when a finished frame looks different
+	// from it, if stale is set or if there's a message on top of it.
+	DrawList lists[2];
+	int shown;
+	bool stale;
+	bool overlay;
+	Sound curSound[4];
+
+	bool debug;
+	bool noSave;
+	char fileName[256];
+} Host;
+
+#endif // host.h
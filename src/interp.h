@@ -0,0 +1,417 @@
+// _____________________________________________________________________________
+//
+//  Frame loop template, included by run.c
+// _____________________________________________________________________________
+//
+// Defines a function called RUNFRAME that runs instructions from the
+// instruction cache until SYS_END, an error or budget instructions have run.
+// If THREADED is 1, every handler jumps straight to the next handler with
+// computed goto (a GCC/Clang extension), otherwise a switch is used.
+//
+// Insn.handler is the raw opcode byte, or a Handler above 0xFF. There's a
+// variant of every opcode handler for each combination of pointer flags (see
+// interp_ops.h), so the dispatch table is indexed by the opcode byte directly
+// and the operands don't need flag tests.
+//
+// vmDecode() has checked the operands known before running (see verify() in
+// vm.c), so only the registers read through pointers and addresses read from
+// registers are checked here. Instructions that failed it go to H_UNVERIFIED.
+//
+// The program counter and stack pointer are kept in local variables and only
+// written back to the VM when leaving the loop or calling a syscall.
+//
+static RunResult RUNFRAME(VM *vm, uint64_t budget) {
+	const Insn *code = vm->code;
+	u8 *r = vm->reg.data;
+
+	if (vm->pc > 0x7FFF) {
+		vmError(vm, "Attempted to execute code at 0x%.4X", vm->pc);
+		return RUN_ERROR;
+	}
+
+	const Insn *ip = &code[vm->pc];
+	u8 sp = vm->sp;
+	uint64_t left = budget;
+	RunResult result;
+	u8 badReg;
+	u16 badAddr;
+
+	#if THREADED
+		// Labels for the 8 variants of every opcode, OP_EXT is only used by
+		// invalid extended opcodes, the valid ones have their own handler
+		#define OPLABELS(F) \
+			[OP_NOP | F] = &&L_OP_NOP_ ## F, [OP_SET | F] = &&L_OP_SET_ ## F, \
+			[OP_LD | F] = &&L_OP_LD_ ## F, [OP_ST | F] = &&L_OP_ST_ ## F, \
+			[OP_ADD | F] = &&L_OP_ADD_ ## F, [OP_SUB | F] = &&L_OP_SUB_ ## F, \
+			[OP_MUL | F] = &&L_OP_MUL_ ## F, [OP_DIV | F] = &&L_OP_DIV_ ## F, \
+			[OP_MOD | F] = &&L_OP_MOD_ ## F, \
+			[OP_AND | F] = &&L_OP_AND_ ## F, [OP_OR | F] = &&L_OP_OR_ ## F, \
+			[OP_XOR | F] = &&L_OP_XOR_ ## F, \
+			[OP_EQ | F] = &&L_OP_EQ_ ## F, [OP_LT | F] = &&L_OP_LT_ ## F, \
+			[OP_GT | F] = &&L_OP_GT_ ## F, \
+			[OP_EQJ | F] = &&L_OP_EQJ_ ## F, [OP_LTJ | F] = &&L_OP_LTJ_ ## F, \
+			[OP_GTJ | F] = &&L_OP_GTJ_ ## F, \
+			[OP_EQC | F] = &&L_OP_EQC_ ## F, [OP_LTC | F] = &&L_OP_LTC_ ## F, \
+			[OP_GTC | F] = &&L_OP_GTC_ ## F, \
+			[OP_ARG | F] = &&L_OP_ARG_ ## F, [OP_JMP | F] = &&L_OP_JMP_ ## F, \
+			[OP_CJ | F] = &&L_OP_CJ_ ## F, [OP_CALL | F] = &&L_OP_CALL_ ## F, \
+			[OP_CC | F] = &&L_OP_CC_ ## F, [OP_RET | F] = &&L_OP_RET_ ## F, \
+			[OP_RETV | F] = &&L_OP_RETV_ ## F, [OP_SYS | F] = &&L_OP_SYS_ ## F, \
+			[OP_CALLF | F] = &&L_OP_CALLF_ ## F, [OP_RETF | F] = &&L_OP_RETF_ ## F, \
+			[OP_EXT | F] = &&L_H_INVALID,
+
+		static const void *labels[H_COUNT] = {
+			OPLABELS(0x00) OPLABELS(0x20) OPLABELS(0x40) OPLABELS(0x60)
+			OPLABELS(0x80) OPLABELS(0xA0) OPLABELS(0xC0) OPLABELS(0xE0)
+			[H_BADPC] = &&L_H_BADPC, [H_INVALID] = &&L_H_INVALID,
+			[H_UNVERIFIED] = &&L_H_UNVERIFIED, [H_IDLE] = &&L_H_IDLE,
+			[H_ARGN] = &&L_H_ARGN,
+			[H_LDX] = &&L_H_LDX, [H_STX] = &&L_H_STX,
+			[H_SHL] = &&L_H_SHL, [H_SHR] = &&L_H_SHR,
+			[H_ROL] = &&L_H_ROL, [H_ROR] = &&L_H_ROR,
+			[H_ADD16] = &&L_H_ADD16, [H_ADDLTJ] = &&L_H_ADDLTJ, [H_ARGSYS] = &&L_H_ARGSYS
+		};
+		#undef OPLABELS
+
+		#define DISPATCH() \
+			if (!left--) goto outOfBudget; \
+			goto *labels[ip->handler];
+		#define NEXT() DISPATCH()
+	#else
+		#define NEXT() goto dispatch
+	#endif
+
+	#define PASTE2(a, b) a ## b
+	#define PASTE(a, b) PASTE2(a, b)
+
+	// Read a register, %62 gets a new random number
+	#define READ(reg) ((reg) == 62 ? vmRand(vm) : r[reg])
+
+	// Read an 8-bit operand, it's a register if its pointer flag is set in FLAGS
+	#define VAL(var, n, flag) \
+		u8 var = (FLAGS & (flag)) ? READ(ip->arg[n]) : ip->arg[n];
+
+	// Read the address operand, it's a register pair if its pointer flag is set
+	#define ADDR(var, flag) \
+		u16 var = (FLAGS & (flag)) ? (READ(ip->addr) << 8 | READ(ip->addr + 1)) : ip->addr;
+
+	// Write to a register given by an operand, it was read from a register if
+	// its pointer flag is set
+	#define SETREG(reg, flag, val) \
+		if ((FLAGS & (flag)) && (reg) > 63) { badReg = reg; goto invalidReg; } \
+		r[reg] = val;
+
+	#define JUMP(addr) \
+		if ((addr) > 0x7FFF) { badAddr = addr; goto invalidPC; } \
+		ip = &code[addr]; \
+		NEXT();
+
+	// See vmCall() and vmReturn()
+	#define CALL(addr) { \
+		Frame *f = &vm->frames[sp++]; \
+		u8 temp[8]; \
+		memcpy(temp, r + 0x20, 8); \
+		memcpy(r + 0x20, f->args, 8); \
+		memcpy(f->args, temp, 8); \
+		memcpy(f->local, r + 0x28, 8); \
+		memset(r + 0x28, 0, 8); \
+		f->ret = ip->next; \
+		vm->argsp = 0; \
+		JUMP(addr); \
+	}
+
+	// See vmCallFast() and vmReturnFast()
+	#define CALLF(addr) { \
+		Frame *f = &vm->frames[sp++]; \
+		u8 temp[8]; \
+		memcpy(temp, r + 0x20, 8); \
+		memcpy(r + 0x20, f->args, 8); \
+		memcpy(f->args, temp, 8); \
+		f->ret = ip->next; \
+		vm->argsp = 0; \
+		JUMP(addr); \
+	}
+
+	// Start the next instruction inside a superinstruction
+	#define STEP() \
+		if (!left--) goto outOfBudget;
+
+	// Operand of a superinstruction
+	#define FVAL(ins, n, flag) (((ins)->op & (flag)) ? READ((ins)->arg[n]) : (ins)->arg[n])
+
+	#define RETURN() { \
+		const Frame *f = &vm->frames[--sp]; \
+		ip = &code[f->ret]; \
+		memcpy(r + 0x20, f->args, 8); \
+		memcpy(r + 0x28, f->local, 8); \
+		NEXT(); \
+	}
+
+	#define RETURNF() { \
+		const Frame *f = &vm->frames[--sp]; \
+		ip = &code[f->ret]; \
+		memcpy(r + 0x20, f->args, 8); \
+		NEXT(); \
+	}
+
+	#if THREADED
+		DISPATCH();
+	#else
+	dispatch:
+		if (!left--) goto outOfBudget;
+
+		switch (ip->handler) {
+	#endif
+
+	// Opcode handlers, one variant for every opcode byte
+	#if THREADED
+		#define HANDLER(h) PASTE(L_ ## h ## _, FLAGS):
+	#else
+		#define HANDLER(h) case h | FLAGS:
+	#endif
+
+	#define FLAGS 0x00
+	#include "interp_ops.h"
+	#define FLAGS 0x20
+	#include "interp_ops.h"
+	#define FLAGS 0x40
+	#include "interp_ops.h"
+	#define FLAGS 0x60
+	#include "interp_ops.h"
+	#define FLAGS 0x80
+	#include "interp_ops.h"
+	#define FLAGS 0xA0
+	#include "interp_ops.h"
+	#define FLAGS 0xC0
+	#include "interp_ops.h"
+	#define FLAGS 0xE0
+	#include "interp_ops.h"
+
+	// The other handlers read the flags from the instruction
+	#undef HANDLER
+	#if THREADED
+		#define HANDLER(h) L_ ## h:
+	#else
+		#define HANDLER(h) case h:
+	#endif
+	#define FLAGS (ip->op)
+
+	// Operands checked by verify() aren't checked here
+	HANDLER(H_ARGN) {
+		const u8 *vals = &vm->mem[ip->addr];
+		int count = ip->arg[0];
+
+		if (vm->argsp > 8 - count) {
+			vmError(vm, "Argument overflow at 0x%.4X", (int) (ip - code));
+			goto error;
+		}
+
+		u8 *args = &vm->frames[sp].args[vm->argsp];
+		for (int i = 0; i < count; i++) {
+			args[i] = (ip->arg[1] & (0b10000000 >> i)) ? READ(vals[i]) : vals[i];
+		}
+		vm->argsp += count;
+
+		ip = &code[ip->next];
+		NEXT();
+	}
+
+	// The address is the base plus the offset register, which is incremented
+	// afterwards if the third pointer flag is set
+	HANDLER(H_LDX) {
+		VAL(reg, 0, 0b10000000);
+		ADDR(base, 0b01000000);
+		u8 off = READ(ip->arg[1]);
+		u16 addr = base + off;
+
+		if (addr > 0x7FFF && addr < 0xE000) {
+			vmError(vm, "Invalid memory read (0x%.4X) at 0x%.4X", addr, (int) (ip - code));
+			goto error;
+		}
+
+		SETREG(reg, 0b10000000, vm->mem[addr]);
+		if (FLAGS & 0b00100000) r[ip->arg[1]] = off + 1;
+		ip = &code[ip->next];
+		NEXT();
+	}
+
+	HANDLER(H_STX) {
+		VAL(reg, 0, 0b10000000);
+		ADDR(base, 0b01000000);
+		u8 off = READ(ip->arg[1]);
+		u16 addr = base + off;
+
+		if (addr < 0xE000) {
+			vmError(vm, "Invalid memory write (0x%.4X) at 0x%.4X", addr, (int) (ip - code));
+			goto error;
+		}
+
+		if ((FLAGS & 0b10000000) && reg > 63) { badReg = reg; goto invalidReg; }
+		vm->mem[addr] = READ(reg);
+		if (FLAGS & 0b00100000) r[ip->arg[1]] = off + 1;
+		ip = &code[ip->next];
+		NEXT();
+	}
+
+	#define SHIFTOP(op) \
+		HANDLER(H_ ## op) { \
+			VAL(val, 0, 0b10000000); \
+			VAL(amount, 1, 0b01000000); \
+			VAL(dest, 2, 0b00100000); \
+			\
+			u16 result = vmShift(OP_ ## op, val, amount); \
+			SETREG(dest, 0b00100000, result & 0xFF); \
+			vm->reg.resH = result >> 8; \
+			ip = &code[ip->next]; \
+			NEXT(); \
+		}
+
+	SHIFTOP(SHL)
+	SHIFTOP(SHR)
+	SHIFTOP(ROL)
+	SHIFTOP(ROR)
+	#undef SHIFTOP
+
+	HANDLER(H_ADD16) {
+		vm->fuseCount[H_ADD16 - FUSE_FIRST]++;
+		u16 result = FVAL(ip, 0, 0b10000000);
+		result += FVAL(ip, 1, 0b01000000);
+		r[ip->arg[2]] = result & 0xFF;
+		vm->reg.resH = result >> 8;
+
+		ip = &code[ip->next];
+		STEP();
+		result = FVAL(ip, 0, 0b10000000) + vm->reg.resH;
+		r[ip->arg[2]] = result & 0xFF;
+		vm->reg.resH = result >> 8;
+		ip = &code[ip->next];
+		NEXT();
+	}
+
+	HANDLER(H_ADDLTJ) {
+		vm->fuseCount[H_ADDLTJ - FUSE_FIRST]++;
+		u16 result = FVAL(ip, 0, 0b10000000) + FVAL(ip, 1, 0b01000000);
+		r[ip->arg[2]] = result & 0xFF;
+		vm->reg.resH = result >> 8;
+
+		ip = &code[ip->next];
+		STEP();
+		if (FVAL(ip, 0, 0b10000000) < FVAL(ip, 1, 0b01000000)) {
+			JUMP(ip->addr);
+		}
+		ip = &code[ip->next];
+		NEXT();
+	}
+
+	HANDLER(H_ARGSYS) {
+		vm->fuseCount[H_ARGSYS - FUSE_FIRST]++;
+		const u8 *vals = &vm->mem[ip->addr];
+		int count = ip->arg[0];
+
+		if (vm->argsp > 8 - count) {
+			vmError(vm, "Argument overflow at 0x%.4X", (int) (ip - code));
+			goto error;
+		}
+
+		u8 *args = &vm->frames[sp].args[vm->argsp];
+		for (int i = 0; i < count; i++) {
+			args[i] = (ip->arg[1] & (0b10000000 >> i)) ? READ(vals[i]) : vals[i];
+		}
+		vm->argsp += count;
+
+		ip = &code[ip->next];
+		STEP();
+		vm->sp = sp;
+		vm->pc = ip->next;
+		if (!vmSyscall(vm, FVAL(ip, 0, 0b10000000))) goto error;
+
+		ip = &code[ip->next];
+		if (vm->needDraw) {
+			result = RUN_END;
+			goto exit;
+		}
+		NEXT();
+	}
+
+	HANDLER(H_BADPC)
+		badAddr = ip - code;
+		goto invalidPC;
+
+	// Let vmExecute() run the instruction with all of its checks and report
+	// the error. The instruction is counted here, not by vmExecute().
+	HANDLER(H_UNVERIFIED)
+		vm->pc = ip - code;
+		vm->sp = sp;
+		vm->insCount--;
+		if (!vmExecute(vm)) goto error;
+
+		sp = vm->sp;
+		JUMP(vm->pc);
+
+	// The jump at the end of an idle loop, vmExecute() ends the frame if it's
+	// taken
+	HANDLER(H_IDLE)
+		vm->pc = ip - code;
+		vm->sp = sp;
+		vm->insCount--;
+		if (!vmExecute(vm)) goto error;
+
+		ip = &code[vm->pc];
+		if (vm->needDraw) {
+			result = RUN_END;
+			goto exit;
+		}
+		NEXT();
+
+	#if !THREADED
+		default:
+	#endif
+	HANDLER(H_INVALID)
+		vmError(vm, "Invalid opcode at 0x%.4X: %d", (int) (ip - code), ip->op & 0b00011111);
+		goto error;
+
+	#if !THREADED
+		}
+	#endif
+
+	#undef HANDLER
+	#undef DISPATCH
+	#undef NEXT
+	#undef READ
+	#undef VAL
+	#undef ADDR
+	#undef SETREG
+	#undef JUMP
+	#undef CALL
+	#undef RETURN
+	#undef CALLF
+	#undef RETURNF
+	#undef STEP
+	#undef FVAL
+	#undef FLAGS
+	#undef PASTE
+	#undef PASTE2
+
+invalidReg:
+	vmError(vm, "Invalid register access (%%%d) at 0x%.4X", badReg, (int) (ip - code));
+	goto error;
+
+invalidPC:
+	vmError(vm, "Attempted to execute code at 0x%.4X", badAddr);
+	goto error;
+
+outOfBudget:
+	// The budget was checked before executing the instruction at ip
+	left = 0;
+	result = RUN_BUDGET;
+	goto exit;
+
+error:
+	result = RUN_ERROR;
+
+exit:
+	vm->pc = ip - code;
+	vm->sp = sp;
+	vm->insCount += budget - left;
+	return result;
+}
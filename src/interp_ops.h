@@ -0,0 +1,232 @@
+// _____________________________________________________________________________
+//
+//  Opcode handlers, included by interp.h
+// _____________________________________________________________________________
+//
+// Included once for every combination of pointer flags, with FLAGS set to the
+// flags (the top 3 bits of the opcode byte). The flag tests in VAL() and
+// ADDR() are constant, so every variant only has the code for its own operand
+// kinds. Only registers read through pointers and addresses read from
+// registers are checked, vmDecode() has checked the rest.
+//
+	HANDLER(OP_NOP)
+		ip = &code[ip->next];
+		NEXT();
+
+	HANDLER(OP_SET) {
+		VAL(reg, 0, 0b10000000);
+		VAL(val, 1, 0b01000000);
+		SETREG(reg, 0b10000000, val);
+		ip = &code[ip->next];
+		NEXT();
+	}
+
+	HANDLER(OP_LD) {
+		VAL(reg, 0, 0b10000000);
+		ADDR(addr, 0b01000000);
+
+		if ((FLAGS & 0b01000000) && addr > 0x7FFF && addr < 0xE000) {
+			vmError(vm, "Invalid memory read (0x%.4X) at 0x%.4X", addr, (int) (ip - code));
+			goto error;
+		}
+
+		SETREG(reg, 0b10000000, vm->mem[addr]);
+		ip = &code[ip->next];
+		NEXT();
+	}
+
+	HANDLER(OP_ST) {
+		VAL(reg, 0, 0b10000000);
+		ADDR(addr, 0b01000000);
+
+		if ((FLAGS & 0b01000000) && addr < 0xE000) {
+			vmError(vm, "Invalid memory write (0x%.4X) at 0x%.4X", addr, (int) (ip - code));
+			goto error;
+		}
+
+		if ((FLAGS & 0b10000000) && reg > 63) { badReg = reg; goto invalidReg; }
+		vm->mem[addr] = READ(reg);
+		ip = &code[ip->next];
+		NEXT();
+	}
+
+	#define BINOP16(op, sign) \
+		HANDLER(OP_ ## op) { \
+			VAL(first, 0, 0b10000000); \
+			VAL(second, 1, 0b01000000); \
+			VAL(dest, 2, 0b00100000); \
+			\
+			u16 result = first sign second; \
+			SETREG(dest, 0b00100000, result & 0xFF); \
+			vm->reg.resH = (result & 0xFF00) >> 8; \
+			ip = &code[ip->next]; \
+			NEXT(); \
+		}
+
+	BINOP16(ADD, +)
+	BINOP16(SUB, -)
+	BINOP16(MUL, *)
+
+	#define DIVOP(op, sign, msg) \
+		HANDLER(OP_ ## op) { \
+			VAL(first, 0, 0b10000000); \
+			VAL(second, 1, 0b01000000); \
+			if (!second) { \
+				vmError(vm, msg, (int) (ip - code)); \
+				goto error; \
+			} \
+			VAL(dest, 2, 0b00100000); \
+			\
+			SETREG(dest, 0b00100000, first sign second); \
+			ip = &code[ip->next]; \
+			NEXT(); \
+		}
+
+	DIVOP(DIV, /, "Division by zero at 0x%.4X")
+	DIVOP(MOD, %, "Division by zero (mod) at 0x%.4X")
+
+	#define BINOP(op, sign) \
+		HANDLER(OP_ ## op) { \
+			VAL(first, 0, 0b10000000); \
+			VAL(second, 1, 0b01000000); \
+			VAL(dest, 2, 0b00100000); \
+			\
+			SETREG(dest, 0b00100000, first sign second); \
+			ip = &code[ip->next]; \
+			NEXT(); \
+		}
+
+	BINOP(AND, &)
+	BINOP(OR, |)
+	BINOP(XOR, ^)
+	BINOP(EQ, ==)
+	BINOP(LT, <)
+	BINOP(GT, >)
+
+	#define BINOPJ(op, sign) \
+		HANDLER(OP_ ## op) { \
+			VAL(first, 0, 0b10000000); \
+			VAL(second, 1, 0b01000000); \
+			ADDR(addr, 0b00100000); \
+			\
+			if (first sign second) { \
+				JUMP(addr); \
+			} \
+			ip = &code[ip->next]; \
+			NEXT(); \
+		}
+
+	BINOPJ(EQJ, ==)
+	BINOPJ(LTJ, <)
+	BINOPJ(GTJ, >)
+
+	#define BINOPCALL(op, sign) \
+		HANDLER(OP_ ## op) { \
+			VAL(first, 0, 0b10000000); \
+			VAL(second, 1, 0b01000000); \
+			ADDR(addr, 0b00100000); \
+			\
+			if (first sign second) { \
+				CALL(addr); \
+			} \
+			ip = &code[ip->next]; \
+			NEXT(); \
+		}
+
+	BINOPCALL(EQC, ==)
+	BINOPCALL(LTC, <)
+	BINOPCALL(GTC, >)
+
+	HANDLER(OP_ARG) {
+		VAL(val, 0, 0b10000000);
+
+		if (vm->argsp > 7) {
+			vmError(vm, "Argument overflow at 0x%.4X", (int) (ip - code));
+			goto error;
+		}
+
+		vm->frames[sp].args[vm->argsp++] = val;
+		ip = &code[ip->next];
+		NEXT();
+	}
+
+	HANDLER(OP_JMP) {
+		ADDR(addr, 0b10000000);
+		JUMP(addr);
+	}
+
+	HANDLER(OP_CJ) {
+		u8 cond = READ(ip->arg[0]);
+		if (FLAGS & 0b10000000) {
+			if (cond > 63) { badReg = cond; goto invalidReg; }
+			cond = READ(cond);
+		}
+		ADDR(addr, 0b01000000);
+
+		if (cond) {
+			JUMP(addr);
+		}
+		ip = &code[ip->next];
+		NEXT();
+	}
+
+	HANDLER(OP_CALL) {
+		ADDR(addr, 0b10000000);
+		CALL(addr);
+	}
+
+	HANDLER(OP_CC) {
+		u8 cond = READ(ip->arg[0]);
+		if (FLAGS & 0b10000000) {
+			if (cond > 63) { badReg = cond; goto invalidReg; }
+			cond = READ(cond);
+		}
+		ADDR(addr, 0b01000000);
+
+		if (cond) {
+			CALL(addr);
+		}
+		ip = &code[ip->next];
+		NEXT();
+	}
+
+	HANDLER(OP_RET) {
+		RETURN();
+	}
+
+	HANDLER(OP_RETV) {
+		VAL(val, 0, 0b10000000);
+		vm->reg.rVal = val;
+		RETURN();
+	}
+
+	HANDLER(OP_SYS) {
+		VAL(call, 0, 0b10000000);
+
+		vm->sp = sp;
+		vm->pc = ip->next;
+		if (!vmSyscall(vm, call)) goto error;
+
+		ip = &code[ip->next];
+		if (vm->needDraw) {
+			result = RUN_END;
+			goto exit;
+		}
+		NEXT();
+	}
+
+	HANDLER(OP_CALLF) {
+		ADDR(addr, 0b10000000);
+		CALLF(addr);
+	}
+
+	HANDLER(OP_RETF) {
+		RETURNF();
+	}
+
+	#undef BINOP16
+	#undef DIVOP
+	#undef BINOP
+	#undef BINOPJ
+	#undef BINOPCALL
+	#undef FLAGS
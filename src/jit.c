@@ -0,0 +1,984 @@
+#include "vm.h"
+
+// _____________________________________________________________________________
+//
+//  x86-64 JIT
+// _____________________________________________________________________________
+//
+// Translates basic blocks from the instruction cache into x86-64 code once
+// they are hot: every entry to a block that hasn't been translated goes back to
+// runJit(), which counts it and runs the block with the interpreter until it
+// has been entered vm->jitHot times. Blocks are stored by ROM address and jump
+// straight to each other: a jump to a block that hasn't been translated yet
+// goes through a table lookup, and is patched into a direct jump once the
+// target is translated.
+//
+// The generated code only handles the normal case. Anything that would cause
+// an error (invalid register, memory access or jump, division by zero,
+// argument overflow) leaves the block and runs that instruction with
+// vmExecute() instead, which reports the error, so the JIT never needs its own
+// error messages. Instructions that could read the rand register more than once
+// are left to vmExecute() too. Syscalls go through vmSyscall(), SYS_END leaves
+// the block.
+//
+// While running a block:
+//     rbx = VM, the registers are at the start of it
+//     r12 = jit->blocks, used for jumps to addresses only known at runtime
+//     r13 = instruction budget left, every block subtracts its length when
+//           entered, so the budget can only run out between blocks
+//     r14 = vm->rng before the instruction, so an exit to the interpreter can
+//           undo reads of the rand register (%62)
+//
+#if defined(__x86_64__) && (defined(__linux__) || defined(_WIN32))
+	#define HAS_JIT
+#endif
+
+#ifndef HAS_JIT
+
+// Other platforms use the interpreter
+RunResult runJit(VM *vm, uint64_t budget) {
+	return vmInterpret(vm, budget);
+}
+
+void jitFlush(VM *vm) { (void) vm; }
+void jitDestroy(VM *vm) { (void) vm; }
+
+#else
+
+#include <stddef.h>
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+#endif
+
+#define JIT_SIZE (4 << 20)    // bytes of generated code before flushing
+#define JIT_MAXBLOCK 64       // max instructions in one block
+#define JIT_BLOCKSPACE 16384  // more than the largest possible block
+#define JIT_MAXPATCH 4096
+#define JIT_MAXBAIL 512
+
+// Why the generated code returned
+typedef enum JitExit {
+	EXIT_NONE,    // keep going, only returned by jitSys()
+	EXIT_END,     // SYS_END
+	EXIT_ERROR,   // a syscall caused an error
+	EXIT_BUDGET,  // not enough budget left to run the block at vm->pc
+	EXIT_LOOKUP,  // no block translated at vm->pc yet
+	EXIT_STEP     // the instruction at vm->pc has to be interpreted
+} JitExit;
+
+struct Jit {
+	u8 *buf;
+	uint32_t used;
+	uint32_t stubEnd;  // blocks start after the shared stubs
+	uint32_t exitStub;
+	uint32_t lookupStub;
+	uint32_t randStub;
+	int (*enter)(VM *vm, void *block, uint64_t budget);
+	uint64_t left;     // budget left when the generated code returned
+
+	void *blocks[CODE_SIZE];
+	uint32_t hits[0x8000];  // entries of each block that wasn't translated
+
+	// Jumps to blocks that weren't translated yet, see emitGoto()
+	struct { uint32_t site; u16 target; } patches[JIT_MAXPATCH];
+	int patchCount;
+
+	// Exits to the interpreter in the block being translated, see bail()
+	struct { uint32_t site; int index; } bails[JIT_MAXBAIL];
+	int bailCount;
+	int index;  // instruction being translated
+};
+
+enum { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
+
+// Condition codes for emitJump()
+enum { ALWAYS = 0, JB = 0x82, JAE = 0x83, JE = 0x84, JNE = 0x85, JBE = 0x86, JA = 0x87 };
+
+#define REG(i) ((uint32_t) (offsetof(VM, reg.data) + (i)))
+#define MEM ((uint32_t) offsetof(VM, mem))
+#define OFF(field) ((uint32_t) offsetof(VM, field))
+#define FRAME(field) ((uint32_t) (offsetof(VM, frames) + offsetof(Frame, field)))
+
+// _____________________________________________________________________________
+//
+//  Helpers called from generated code
+// _____________________________________________________________________________
+//
+static void jitRand(VM *vm) {
+	vmRand(vm);
+}
+
+static int jitSys(VM *vm, int call, int next) {
+	vm->pc = next;
+	if (!vmSyscall(vm, call)) return EXIT_ERROR;
+	return vm->needDraw ? EXIT_END : EXIT_NONE;
+}
+
+// _____________________________________________________________________________
+//
+//  Instruction encoding
+// _____________________________________________________________________________
+//
+static void emitBytes(Jit *jit, const u8 *bytes, int n) {
+	memcpy(jit->buf + jit->used, bytes, n);
+	jit->used += n;
+}
+
+#define EMIT(...) emitBytes(jit, (const u8[]) {__VA_ARGS__}, sizeof((const u8[]) {__VA_ARGS__}))
+
+static void emit32(Jit *jit, uint32_t val) {
+	memcpy(jit->buf + jit->used, &val, 4);
+	jit->used += 4;
+}
+
+static void emit64(Jit *jit, uint64_t val) {
+	memcpy(jit->buf + jit->used, &val, 8);
+	jit->used += 8;
+}
+
+// Point the rel32 at site to a position in the buffer
+static void setTarget(Jit *jit, uint32_t site, uint32_t target) {
+	int32_t rel = (int32_t) target - (int32_t) (site + 4);
+	memcpy(jit->buf + site, &rel, 4);
+}
+
+// jmp/jcc rel32, returns the position of the rel32 for setTarget()
+static uint32_t emitJump(Jit *jit, u8 cc) {
+	if (cc == ALWAYS) EMIT(0xE9);
+	else EMIT(0x0F, cc);
+	emit32(jit, 0);
+	return jit->used - 4;
+}
+
+// movzx dst, byte [rbx + disp]
+static void loadByte(Jit *jit, int dst, uint32_t disp) {
+	EMIT(0x0F, 0xB6, 0x83 | dst << 3);
+	emit32(jit, disp);
+}
+
+// movzx dst, byte [rbx + index + disp]
+static void loadIndexed(Jit *jit, int dst, int index, uint32_t disp) {
+	EMIT(0x0F, 0xB6, 0x84 | dst << 3, index << 3 | EBX);
+	emit32(jit, disp);
+}
+
+// mov [rbx + disp], src8
+static void storeByte(Jit *jit, int src, uint32_t disp) {
+	EMIT(0x88, 0x83 | src << 3);
+	emit32(jit, disp);
+}
+
+// mov [rbx + index + disp], src8
+static void storeIndexed(Jit *jit, int src, int index, uint32_t disp) {
+	EMIT(0x88, 0x84 | src << 3, index << 3 | EBX);
+	emit32(jit, disp);
+}
+
+// mov dst, imm32
+static void loadImm(Jit *jit, int dst, uint32_t imm) {
+	EMIT(0xB8 + dst);
+	emit32(jit, imm);
+}
+
+// cmp reg, imm32
+static void cmpImm(Jit *jit, int reg, uint32_t imm) {
+	EMIT(0x81, 0xF8 | reg);
+	emit32(jit, imm);
+}
+
+// Call a C function with the VM as the first argument. Any other arguments
+// have to be set up before this.
+static void callHelper(Jit *jit, void *func) {
+	#ifdef _WIN32
+		EMIT(0x48, 0x89, 0xD9);  // mov rcx, rbx
+	#else
+		EMIT(0x48, 0x89, 0xDF);  // mov rdi, rbx
+	#endif
+	EMIT(0x48, 0xB8);  // mov rax, func
+	emit64(jit, (uintptr_t) func);
+	EMIT(0xFF, 0xD0);  // call rax
+}
+
+// Get a new value into the rand register, without changing any registers
+static void emitRand(Jit *jit) {
+	EMIT(0xE8);  // call randStub
+	emit32(jit, 0);
+	setTarget(jit, jit->used - 4, jit->randStub);
+}
+
+// movzx dst, byte [rbx + REG(i)], %62 gets a new random number first
+static void readReg(Jit *jit, int dst, u16 i) {
+	if (i == 62) emitRand(jit);
+	loadByte(jit, dst, REG(i));
+}
+
+// movzx dst, byte [rbx + index + REG(0)], the register is only known at runtime
+static void readIndexed(Jit *jit, int dst, int index) {
+	cmpImm(jit, index, 62);
+	uint32_t skip = emitJump(jit, JNE);
+	emitRand(jit);
+	setTarget(jit, skip, jit->used);
+	loadIndexed(jit, dst, index, REG(0));
+}
+
+// Leave the generated code, see JitExit
+static void emitExit(Jit *jit, JitExit why, u16 pc) {
+	loadImm(jit, ECX, pc);
+	loadImm(jit, EAX, why);
+	setTarget(jit, emitJump(jit, ALWAYS), jit->exitStub);
+}
+
+// Continue at a ROM address known when translating. If the block isn't
+// translated yet, the jump goes through the lookup stub and is patched into a
+// direct jump later.
+static void emitGoto(Jit *jit, u16 target) {
+	if (target < 0x8000 && jit->blocks[target]) {
+		setTarget(jit, emitJump(jit, ALWAYS), (u8 *) jit->blocks[target] - jit->buf);
+		return;
+	}
+
+	uint32_t site = jit->used;
+	loadImm(jit, ECX, target);
+	setTarget(jit, emitJump(jit, ALWAYS), jit->lookupStub);
+
+	if (target < 0x8000 && jit->patchCount < JIT_MAXPATCH) {
+		jit->patches[jit->patchCount].site = site;
+		jit->patches[jit->patchCount++].target = target;
+	}
+}
+
+// Continue at the address in ecx, which has been checked already
+static void emitGotoEcx(Jit *jit) {
+	setTarget(jit, emitJump(jit, ALWAYS), jit->lookupStub);
+}
+
+// Leave the block and interpret the current instruction if the condition is
+// true. Only used for errors, so the instruction must not have changed anything
+// yet.
+static void bail(Jit *jit, u8 cc) {
+	jit->bails[jit->bailCount].site = emitJump(jit, cc);
+	jit->bails[jit->bailCount++].index = jit->index;
+}
+
+// _____________________________________________________________________________
+//
+//  Operands
+// _____________________________________________________________________________
+//
+// Load an 8-bit operand, see VAL() in interp.h. Returns false if it's an
+// invalid register.
+static bool val(Jit *jit, const Insn *ins, int n, u8 flag, int dst) {
+	u8 arg = ins->arg[n];
+
+	if (ins->op & flag) {
+		if (arg > 63) return false;
+		readReg(jit, dst, arg);
+	}
+	else loadImm(jit, dst, arg);
+	return true;
+}
+
+#define DEST_EDX -1
+#define DEST_INVALID -2
+
+// Get the register an operand refers to, for SETREG() and ST. Returns the
+// register number if it's known when translating, otherwise loads it into edx
+// and checks it.
+static int dest(Jit *jit, const Insn *ins, int n, u8 flag) {
+	u8 arg = ins->arg[n];
+
+	if (ins->op & flag) {
+		if (arg > 63) return DEST_INVALID;
+		readReg(jit, EDX, arg);
+		cmpImm(jit, EDX, 63);
+		bail(jit, JA);
+		return DEST_EDX;
+	}
+	return arg > 63 ? DEST_INVALID : arg;
+}
+
+static void storeDest(Jit *jit, int reg, int src) {
+	if (reg == DEST_EDX) storeIndexed(jit, src, EDX, REG(0));
+	else storeByte(jit, src, REG(reg));
+}
+
+// Get the address operand. Returns it if it's known when translating,
+// otherwise loads it into ecx and returns -1.
+static int addr(Jit *jit, const Insn *ins, u8 flag) {
+	if (!(ins->op & flag)) return ins->addr;
+
+	readReg(jit, ECX, ins->addr);
+	EMIT(0xC1, 0xE1, 0x08);  // shl ecx, 8
+	readReg(jit, EDX, ins->addr + 1);
+	EMIT(0x09, 0xD1);  // or ecx, edx
+	return -1;
+}
+
+// _____________________________________________________________________________
+//
+//  Control flow
+// _____________________________________________________________________________
+//
+// Jump to the address operand, see JUMP() in interp.h
+static void jump(Jit *jit, const Insn *ins, u8 flag) {
+	int target = addr(jit, ins, flag);
+
+	if (target < 0) {
+		cmpImm(jit, ECX, 0x7FFF);
+		bail(jit, JA);
+		emitGotoEcx(jit);
+	}
+	else if (target > 0x7FFF) bail(jit, ALWAYS);
+	else emitGoto(jit, target);
+}
+
+// Call the address operand, see CALL() in interp.h. The address is read before
+// the arguments and locals are swapped, like the interpreter does. CALLF
+// doesn't save the locals.
+static void call(Jit *jit, const Insn *ins, u8 flag, bool locals) {
+	int target = addr(jit, ins, flag);
+
+	if (target < 0) {
+		cmpImm(jit, ECX, 0x7FFF);
+		bail(jit, JA);
+		EMIT(0x89, 0xCE);  // mov esi, ecx
+	}
+	else if (target > 0x7FFF) {
+		bail(jit, ALWAYS);
+		return;
+	}
+
+	loadByte(jit, ECX, OFF(sp));
+	EMIT(0x6B, 0xD1, sizeof(Frame));  // imul edx, ecx, sizeof(Frame)
+	EMIT(0x48, 0x8B, 0x83); emit32(jit, REG(0x20));               // mov rax, args
+	EMIT(0x48, 0x8B, 0xBC, 0x13); emit32(jit, FRAME(args));       // mov rdi, frames[sp].args
+	EMIT(0x48, 0x89, 0x84, 0x13); emit32(jit, FRAME(args));       // mov frames[sp].args, rax
+	EMIT(0x48, 0x89, 0xBB); emit32(jit, REG(0x20));               // mov args, rdi
+	if (locals) {
+		EMIT(0x48, 0x8B, 0x83); emit32(jit, REG(0x28));               // mov rax, locals
+		EMIT(0x48, 0x89, 0x84, 0x13); emit32(jit, FRAME(local));      // mov frames[sp].local, rax
+		EMIT(0x48, 0xC7, 0x83); emit32(jit, REG(0x28)); emit32(jit, 0);  // mov locals, 0
+	}
+	EMIT(0x66, 0xC7, 0x84, 0x13); emit32(jit, FRAME(ret));        // mov frames[sp].ret, next
+	EMIT(ins->next & 0xFF, ins->next >> 8);
+	EMIT(0xFF, 0xC1);  // inc ecx
+	storeByte(jit, ECX, OFF(sp));
+	EMIT(0xC6, 0x83); emit32(jit, OFF(argsp)); EMIT(0);  // mov argsp, 0
+
+	if (target < 0) {
+		EMIT(0x89, 0xF1);  // mov ecx, esi
+		emitGotoEcx(jit);
+	}
+	else emitGoto(jit, target);
+}
+
+// See RETURN() and RETURNF() in interp.h
+static void ret(Jit *jit, bool locals) {
+	loadByte(jit, ECX, OFF(sp));
+	EMIT(0xFF, 0xC9);        // dec ecx
+	EMIT(0x0F, 0xB6, 0xC9);  // movzx ecx, cl
+	storeByte(jit, ECX, OFF(sp));
+	EMIT(0x6B, 0xD1, sizeof(Frame));  // imul edx, ecx, sizeof(Frame)
+	EMIT(0x48, 0x8B, 0x84, 0x13); emit32(jit, FRAME(args));       // mov rax, frames[sp].args
+	EMIT(0x48, 0x89, 0x83); emit32(jit, REG(0x20));               // mov args, rax
+	if (locals) {
+		EMIT(0x48, 0x8B, 0x84, 0x13); emit32(jit, FRAME(local));  // mov rax, frames[sp].local
+		EMIT(0x48, 0x89, 0x83); emit32(jit, REG(0x28));           // mov locals, rax
+	}
+	EMIT(0x0F, 0xB7, 0x8C, 0x13); emit32(jit, FRAME(ret));        // movzx ecx, frames[sp].ret
+
+	// Return addresses are always inside the instruction cache, jumps to the
+	// end of it aren't translated and go to the interpreter
+	emitGotoEcx(jit);
+}
+
+// Load the condition of CJ/CC into eax and test it. Returns false if it's an
+// invalid register.
+static bool cond(Jit *jit, const Insn *ins) {
+	u8 condReg = ins->arg[0];
+	if (condReg > 63) return false;
+	readReg(jit, EAX, condReg);
+
+	if (ins->op & 0b10000000) {
+		cmpImm(jit, EAX, 63);
+		bail(jit, JA);
+		readIndexed(jit, EAX, EAX);
+	}
+
+	EMIT(0x85, 0xC0);  // test eax, eax
+	return true;
+}
+
+// _____________________________________________________________________________
+//
+//  Translation
+// _____________________________________________________________________________
+//
+static bool endsBlock(u16 opcode) {
+	switch (opcode) {
+		case OP_EQJ: case OP_LTJ: case OP_GTJ:
+		case OP_EQC: case OP_LTC: case OP_GTC:
+		case OP_JMP: case OP_CJ: case OP_CALL: case OP_CC:
+		case OP_RET: case OP_RETV: case OP_SYS: case OP_CALLF: case OP_RETF:
+			return true;
+
+		default:
+			return opcode >= OP_COUNT;
+	}
+}
+
+// Translate one instruction. Returns false if it can't be translated, the
+// caller then makes the whole instruction exit to the interpreter.
+static bool translate(const VM *vm, Jit *jit, const Insn *ins) {
+	int reg, target;
+	uint32_t skip;
+
+	// The end of an idle loop can end the frame, see vmExecute(). Instructions
+	// that failed vmDecode()'s checks are left to vmExecute() to report.
+	if (ins->handler == H_IDLE || ins->handler == H_UNVERIFIED) return false;
+
+	// The operands aren't read in the interpreter's order, which only matters
+	// if more than one of them can be the rand register
+	bool dynamic;
+	int randReads = vmRandReads(vm, ins, &dynamic);
+	if (randReads > 1 || (randReads && dynamic)) return false;
+
+	switch (ins->opcode) {
+		case OP_NOP:
+			return true;
+
+		case OP_SET:
+			if (!val(jit, ins, 1, 0b01000000, EAX)) return false;
+			if ((reg = dest(jit, ins, 0, 0b10000000)) == DEST_INVALID) return false;
+			storeDest(jit, reg, EAX);
+			return true;
+
+		case OP_LD:
+			target = addr(jit, ins, 0b01000000);
+			if (target > 0x7FFF && target < 0xE000) return false;
+			if (target < 0) {
+				cmpImm(jit, ECX, 0x7FFF);
+				skip = emitJump(jit, JBE);
+				cmpImm(jit, ECX, 0xE000);
+				bail(jit, JB);
+				setTarget(jit, skip, jit->used);
+			}
+
+			if ((reg = dest(jit, ins, 0, 0b10000000)) == DEST_INVALID) return false;
+			if (target < 0) loadIndexed(jit, EAX, ECX, MEM);
+			else loadByte(jit, EAX, MEM + target);
+			storeDest(jit, reg, EAX);
+			return true;
+
+		case OP_ST:
+			target = addr(jit, ins, 0b01000000);
+			if (target >= 0 && target < 0xE000) return false;
+			if (target < 0) {
+				cmpImm(jit, ECX, 0xE000);
+				bail(jit, JB);
+			}
+
+			if ((reg = dest(jit, ins, 0, 0b10000000)) == DEST_INVALID) return false;
+			if (reg == DEST_EDX) readIndexed(jit, EAX, EDX);
+			else readReg(jit, EAX, reg);
+
+			if (target < 0) storeIndexed(jit, EAX, ECX, MEM);
+			else storeByte(jit, EAX, MEM + target);
+			return true;
+
+		case OP_ADD: case OP_SUB: case OP_MUL:
+		case OP_AND: case OP_OR: case OP_XOR:
+		case OP_EQ: case OP_LT: case OP_GT:
+			if (!val(jit, ins, 0, 0b10000000, EAX)) return false;
+			if (!val(jit, ins, 1, 0b01000000, ECX)) return false;
+			if ((reg = dest(jit, ins, 2, 0b00100000)) == DEST_INVALID) return false;
+
+			switch (ins->opcode) {
+				case OP_ADD: EMIT(0x01, 0xC8); break;        // add eax, ecx
+				case OP_SUB: EMIT(0x29, 0xC8); break;        // sub eax, ecx
+				case OP_MUL: EMIT(0x0F, 0xAF, 0xC1); break;  // imul eax, ecx
+				case OP_AND: EMIT(0x21, 0xC8); break;        // and eax, ecx
+				case OP_OR: EMIT(0x09, 0xC8); break;         // or eax, ecx
+				case OP_XOR: EMIT(0x31, 0xC8); break;        // xor eax, ecx
+				case OP_EQ: EMIT(0x39, 0xC8, 0x0F, 0x94, 0xC0); break;  // cmp eax, ecx; sete al
+				case OP_LT: EMIT(0x39, 0xC8, 0x0F, 0x92, 0xC0); break;  // cmp eax, ecx; setb al
+				case OP_GT: EMIT(0x39, 0xC8, 0x0F, 0x97, 0xC0); break;  // cmp eax, ecx; seta al
+			}
+			storeDest(jit, reg, EAX);
+
+			// High byte of the 16-bit result
+			if (ins->opcode <= OP_MUL) {
+				EMIT(0xC1, 0xE8, 0x08);  // shr eax, 8
+				storeByte(jit, EAX, REG(63));
+			}
+			return true;
+
+		case OP_DIV: case OP_MOD:
+			if (!val(jit, ins, 0, 0b10000000, EAX)) return false;
+			if (!val(jit, ins, 1, 0b01000000, ECX)) return false;
+			if (!(ins->op & 0b01000000) && !ins->arg[1]) return false;
+			if (ins->op & 0b01000000) {
+				EMIT(0x85, 0xC9);  // test ecx, ecx
+				bail(jit, JE);
+			}
+
+			EMIT(0x31, 0xD2, 0xF7, 0xF1);  // xor edx, edx; div ecx
+			if (ins->opcode == OP_MOD) EMIT(0x89, 0xD0);  // mov eax, edx
+
+			if ((reg = dest(jit, ins, 2, 0b00100000)) == DEST_INVALID) return false;
+			storeDest(jit, reg, EAX);
+			return true;
+
+		// Leaves resH in ah, see vmShift()
+		case OP_SHL: case OP_SHR: case OP_ROL: case OP_ROR:
+			if (!val(jit, ins, 0, 0b10000000, EAX)) return false;
+			if (!val(jit, ins, 1, 0b01000000, ECX)) return false;
+			if ((reg = dest(jit, ins, 2, 0b00100000)) == DEST_INVALID) return false;
+
+			if (ins->opcode <= OP_SHR) {
+				loadImm(jit, ESI, 16);
+				EMIT(0x39, 0xF1);        // cmp ecx, esi
+				EMIT(0x0F, 0x47, 0xCE);  // cmova ecx, esi
+			} else {
+				EMIT(0x83, 0xE1, 0x07);  // and ecx, 7
+			}
+
+			if (ins->opcode == OP_SHL || ins->opcode == OP_ROL) {
+				EMIT(0xD3, 0xE0);  // shl eax, cl
+			} else {
+				EMIT(0xC1, 0xE0, 0x08);        // shl eax, 8
+				EMIT(0xD3, 0xE8);              // shr eax, cl
+				EMIT(0x66, 0xC1, 0xC0, 0x08);  // rol ax, 8
+			}
+
+			// Rotates put the bits that went around back in al
+			if (ins->opcode >= OP_ROL) {
+				EMIT(0x89, 0xC6);        // mov esi, eax
+				EMIT(0xC1, 0xEE, 0x08);  // shr esi, 8
+				EMIT(0x09, 0xF0);        // or eax, esi
+			}
+
+			storeDest(jit, reg, EAX);
+			EMIT(0xC1, 0xE8, 0x08);  // shr eax, 8
+			storeByte(jit, EAX, REG(63));
+			return true;
+
+		case OP_EQJ: case OP_LTJ: case OP_GTJ:
+		case OP_EQC: case OP_LTC: case OP_GTC:
+			if (!val(jit, ins, 0, 0b10000000, EAX)) return false;
+			if (!val(jit, ins, 1, 0b01000000, ECX)) return false;
+			EMIT(0x39, 0xC8);  // cmp eax, ecx
+
+			// Skip the jump/call if the condition is false
+			switch (ins->opcode) {
+				case OP_EQJ: case OP_EQC: skip = emitJump(jit, JNE); break;
+				case OP_LTJ: case OP_LTC: skip = emitJump(jit, JAE); break;
+				default: skip = emitJump(jit, JBE); break;
+			}
+
+			if (ins->opcode <= OP_GTJ) jump(jit, ins, 0b00100000);
+			else call(jit, ins, 0b00100000, true);
+
+			setTarget(jit, skip, jit->used);
+			emitGoto(jit, ins->next);
+			return true;
+
+		case OP_ARG:
+			if (!val(jit, ins, 0, 0b10000000, EAX)) return false;
+			loadByte(jit, ECX, OFF(argsp));
+			cmpImm(jit, ECX, 7);
+			bail(jit, JA);
+
+			loadByte(jit, EDX, OFF(sp));
+			EMIT(0x6B, 0xD2, sizeof(Frame));  // imul edx, edx, sizeof(Frame)
+			EMIT(0x01, 0xCA);  // add edx, ecx
+			storeIndexed(jit, EAX, EDX, FRAME(args));
+			EMIT(0xFF, 0xC1);  // inc ecx
+			storeByte(jit, ECX, OFF(argsp));
+			return true;
+
+		// The address is in ecx and the offset in esi
+		case OP_LDX: case OP_STX:
+			if (ins->arg[1] > 63) return false;
+			target = addr(jit, ins, 0b01000000);
+			if (target >= 0) loadImm(jit, ECX, target);
+			readReg(jit, ESI, ins->arg[1]);
+			EMIT(0x01, 0xF1);        // add ecx, esi
+			EMIT(0x0F, 0xB7, 0xC9);  // movzx ecx, cx
+
+			if (ins->opcode == OP_LDX) {
+				cmpImm(jit, ECX, 0x7FFF);
+				skip = emitJump(jit, JBE);
+				cmpImm(jit, ECX, 0xE000);
+				bail(jit, JB);
+				setTarget(jit, skip, jit->used);
+
+				if ((reg = dest(jit, ins, 0, 0b10000000)) == DEST_INVALID) return false;
+				loadIndexed(jit, EAX, ECX, MEM);
+				storeDest(jit, reg, EAX);
+			} else {
+				cmpImm(jit, ECX, 0xE000);
+				bail(jit, JB);
+
+				if ((reg = dest(jit, ins, 0, 0b10000000)) == DEST_INVALID) return false;
+				if (reg == DEST_EDX) readIndexed(jit, EAX, EDX);
+				else readReg(jit, EAX, reg);
+				storeIndexed(jit, EAX, ECX, MEM);
+			}
+
+			if (ins->op & 0b00100000) {
+				EMIT(0x8D, 0x46, 0x01);  // lea eax, [rsi + 1]
+				storeByte(jit, EAX, REG(ins->arg[1]));
+			}
+			return true;
+
+		case OP_ARGN: {
+			const u8 *vals = &vm->mem[ins->addr];
+			int count = ins->arg[0];
+
+			loadByte(jit, ECX, OFF(argsp));
+			cmpImm(jit, ECX, 8 - count);
+			bail(jit, JA);
+
+			loadByte(jit, EDX, OFF(sp));
+			EMIT(0x6B, 0xD2, sizeof(Frame));  // imul edx, edx, sizeof(Frame)
+			EMIT(0x01, 0xCA);  // add edx, ecx
+			for (int i = 0; i < count; i++) {
+				if (ins->arg[1] & (0b10000000 >> i)) readReg(jit, EAX, vals[i]);
+				else loadImm(jit, EAX, vals[i]);
+				storeIndexed(jit, EAX, EDX, FRAME(args) + i);
+			}
+			EMIT(0x83, 0xC1, count);  // add ecx, count
+			storeByte(jit, ECX, OFF(argsp));
+			return true;
+		}
+
+		case OP_JMP:
+			jump(jit, ins, 0b10000000);
+			return true;
+
+		case OP_CJ: case OP_CC:
+			if (!cond(jit, ins)) return false;
+			skip = emitJump(jit, JE);
+
+			if (ins->opcode == OP_CJ) jump(jit, ins, 0b01000000);
+			else call(jit, ins, 0b01000000, true);
+
+			setTarget(jit, skip, jit->used);
+			emitGoto(jit, ins->next);
+			return true;
+
+		case OP_CALL: case OP_CALLF:
+			call(jit, ins, 0b10000000, ins->opcode == OP_CALL);
+			return true;
+
+		case OP_RETV:
+			if (!val(jit, ins, 0, 0b10000000, EAX)) return false;
+			storeByte(jit, EAX, REG(48));
+			ret(jit, true);
+			return true;
+
+		case OP_RET: case OP_RETF:
+			ret(jit, ins->opcode == OP_RET);
+			return true;
+
+		case OP_SYS:
+			if (!val(jit, ins, 0, 0b10000000, EAX)) return false;
+			#ifdef _WIN32
+				EMIT(0x89, 0xC2);  // mov edx, eax
+				EMIT(0x41, 0xB8); emit32(jit, ins->next);  // mov r8d, next
+			#else
+				EMIT(0x89, 0xC6);  // mov esi, eax
+				loadImm(jit, EDX, ins->next);
+			#endif
+			callHelper(jit, jitSys);
+
+			EMIT(0x85, 0xC0);  // test eax, eax
+			skip = emitJump(jit, JE);
+			loadImm(jit, ECX, ins->next);
+			setTarget(jit, emitJump(jit, ALWAYS), jit->exitStub);
+
+			setTarget(jit, skip, jit->used);
+			emitGoto(jit, ins->next);
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+// Get the addresses of the instructions in the block starting at pc, returns
+// how many there are. 0 if the first instruction can't be executed.
+static int findBlock(const VM *vm, u16 pc, u16 *pcs) {
+	int count = 0;
+
+	for (u16 p = pc; count < JIT_MAXBLOCK; p = vm->code[p].next) {
+		if (vm->code[p].opcode >= OP_COUNT) break;
+		pcs[count++] = p;
+		if (endsBlock(vm->code[p].opcode)) break;
+	}
+	return count;
+}
+
+// Translate the block starting at pc. Returns NULL if the first instruction
+// can't be executed.
+static void *compile(VM *vm, Jit *jit, u16 pc) {
+	u16 pcs[JIT_MAXBLOCK];
+	int count = findBlock(vm, pc, pcs);
+	if (!count) return NULL;
+
+	if (jit->used + JIT_BLOCKSPACE > JIT_SIZE) jitFlush(vm);
+
+	uint32_t start = jit->used;
+	jit->bailCount = 0;
+
+	// Check and subtract the budget
+	EMIT(0x49, 0x81, 0xFD); emit32(jit, count);  // cmp r13, count
+	uint32_t noBudget = emitJump(jit, JB);
+	EMIT(0x49, 0x81, 0xED); emit32(jit, count);  // sub r13, count
+
+	bool finished = false;
+	bool saveRng[JIT_MAXBLOCK] = {0};
+	for (jit->index = 0; jit->index < count; jit->index++) {
+		const Insn *ins = &vm->code[pcs[jit->index]];
+
+		// Remember the generator's state if the instruction can read the rand
+		// register, for exits to the interpreter
+		bool dynamic;
+		if (vmRandReads(vm, ins, &dynamic) || dynamic) {
+			EMIT(0x44, 0x8B, 0xB3); emit32(jit, OFF(rng));  // mov r14d, vm->rng
+			saveRng[jit->index] = true;
+		}
+
+		if (!translate(vm, jit, ins)) {
+			bail(jit, ALWAYS);
+			finished = true;
+			break;
+		}
+		if (endsBlock(ins->opcode)) {
+			finished = true;
+			break;
+		}
+	}
+	if (!finished) emitGoto(jit, vm->code[pcs[count - 1]].next);
+
+	setTarget(jit, noBudget, jit->used);
+	emitExit(jit, EXIT_BUDGET, pc);
+
+	// Exits to the interpreter, the instructions that weren't run are given
+	// back to the budget
+	uint32_t bailStubs[JIT_MAXBLOCK] = {0};
+	for (int i = 0; i < jit->bailCount; i++) {
+		int index = jit->bails[i].index;
+
+		if (!bailStubs[index]) {
+			bailStubs[index] = jit->used;
+			if (saveRng[index]) {
+				EMIT(0x44, 0x89, 0xB3); emit32(jit, OFF(rng));  // mov vm->rng, r14d
+			}
+			EMIT(0x49, 0x81, 0xC5); emit32(jit, count - index);  // add r13, count - index
+			emitExit(jit, EXIT_STEP, pcs[index]);
+		}
+		setTarget(jit, jit->bails[i].site, bailStubs[index]);
+	}
+
+	jit->blocks[pc] = jit->buf + start;
+	vm->jitBlocks++;
+
+	// Link the blocks that were waiting for this one
+	for (int i = 0; i < jit->patchCount; i++) {
+		if (jit->patches[i].target != pc) continue;
+
+		uint32_t site = jit->patches[i].site;
+		jit->buf[site] = 0xE9;  // mov ecx, target -> jmp block
+		setTarget(jit, site + 1, start);
+		jit->patches[i--] = jit->patches[--jit->patchCount];
+	}
+
+	return jit->blocks[pc];
+}
+
+// _____________________________________________________________________________
+//
+//  Running
+// _____________________________________________________________________________
+//
+// Code shared by all blocks: entering and leaving the generated code, and
+// jumping to an address that is only known at runtime.
+static void emitStubs(Jit *jit) {
+	// int enter(VM *vm, void *block, uint64_t budget)
+	jit->enter = (void *) jit->buf;
+	EMIT(0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);  // push rbx, r12-r15
+	#ifdef _WIN32
+		EMIT(0x56, 0x57);              // push rsi, rdi
+		EMIT(0x48, 0x83, 0xEC, 0x20);  // sub rsp, 32 (shadow space)
+		EMIT(0x48, 0x89, 0xCB);        // mov rbx, rcx
+		EMIT(0x4D, 0x89, 0xC5);        // mov r13, r8
+		EMIT(0x49, 0xBC); emit64(jit, (uintptr_t) jit->blocks);  // mov r12, blocks
+		EMIT(0xFF, 0xE2);              // jmp rdx
+	#else
+		EMIT(0x48, 0x89, 0xFB);        // mov rbx, rdi
+		EMIT(0x49, 0x89, 0xD5);        // mov r13, rdx
+		EMIT(0x49, 0xBC); emit64(jit, (uintptr_t) jit->blocks);  // mov r12, blocks
+		EMIT(0xFF, 0xE6);              // jmp rsi
+	#endif
+
+	// eax = JitExit, ecx = pc
+	jit->exitStub = jit->used;
+	EMIT(0x66, 0x89, 0x8B); emit32(jit, OFF(pc));  // mov vm->pc, cx
+	EMIT(0x48, 0xBA); emit64(jit, (uintptr_t) &jit->left);  // mov rdx, &left
+	EMIT(0x4C, 0x89, 0x2A);  // mov [rdx], r13
+	#ifdef _WIN32
+		EMIT(0x48, 0x83, 0xC4, 0x20);  // add rsp, 32
+		EMIT(0x5F, 0x5E);              // pop rdi, rsi
+	#endif
+	EMIT(0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B);  // pop r15-r12, rbx
+	EMIT(0xC3);  // ret
+
+	// ecx = pc
+	jit->lookupStub = jit->used;
+	EMIT(0x49, 0x8B, 0x04, 0xCC);  // mov rax, [r12 + rcx*8]
+	EMIT(0x48, 0x85, 0xC0);        // test rax, rax
+	uint32_t miss = emitJump(jit, JE);
+	EMIT(0xFF, 0xE0);              // jmp rax
+	setTarget(jit, miss, jit->used);
+	loadImm(jit, EAX, EXIT_LOOKUP);
+	setTarget(jit, emitJump(jit, ALWAYS), jit->exitStub);
+
+	// Called from generated code, keeps every register the C helper could change
+	jit->randStub = jit->used;
+	EMIT(0x50, 0x51, 0x52, 0x56, 0x57);  // push rax, rcx, rdx, rsi, rdi
+	EMIT(0x41, 0x50, 0x41, 0x51, 0x41, 0x52, 0x41, 0x53);  // push r8-r11
+	#ifdef _WIN32
+		EMIT(0x48, 0x83, 0xEC, 0x20);  // sub rsp, 32 (shadow space)
+	#endif
+	callHelper(jit, jitRand);
+	#ifdef _WIN32
+		EMIT(0x48, 0x83, 0xC4, 0x20);  // add rsp, 32
+	#endif
+	EMIT(0x41, 0x5B, 0x41, 0x5A, 0x41, 0x59, 0x41, 0x58);  // pop r11-r8
+	EMIT(0x5F, 0x5E, 0x5A, 0x59, 0x58);  // pop rdi, rsi, rdx, rcx, rax
+	EMIT(0xC3);  // ret
+
+	jit->stubEnd = jit->used;
+}
+
+static Jit *jitCreate(VM *vm) {
+	Jit *jit = calloc(1, sizeof(Jit));
+	if (!jit) return NULL;
+
+	#ifdef _WIN32
+		jit->buf = VirtualAlloc(NULL, JIT_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+	#else
+		jit->buf = mmap(NULL, JIT_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (jit->buf == MAP_FAILED) jit->buf = NULL;
+	#endif
+
+	if (!jit->buf) {
+		free(jit);
+		return NULL;
+	}
+
+	emitStubs(jit);
+	vm->jit = jit;
+	return jit;
+}
+
+// Forget all translated blocks and how hot they were, called when the ROM
+// changes or the buffer is full
+void jitFlush(VM *vm) {
+	Jit *jit = vm->jit;
+	if (!jit) return;
+
+	memset(jit->blocks, 0, sizeof(jit->blocks));
+	memset(jit->hits, 0, sizeof(jit->hits));
+	jit->patchCount = 0;
+	jit->used = jit->stubEnd;
+}
+
+void jitDestroy(VM *vm) {
+	Jit *jit = vm->jit;
+	if (!jit) return;
+
+	#ifdef _WIN32
+		VirtualFree(jit->buf, 0, MEM_RELEASE);
+	#else
+		munmap(jit->buf, JIT_SIZE);
+	#endif
+	free(jit);
+	vm->jit = NULL;
+}
+
+// Run the block at vm->pc with the interpreter, because it isn't hot enough
+// to translate yet. Returns RUN_BUDGET if it ran until the end of the block,
+// and subtracts the instructions it ran from *left.
+static RunResult runCold(VM *vm, Jit *jit, uint64_t *left) {
+	u16 pcs[JIT_MAXBLOCK];
+	uint64_t count = findBlock(vm, vm->pc, pcs);
+	if (count > *left) count = *left;
+
+	if (!jit->hits[vm->pc]++) vm->jitColdBlocks++;
+	vm->jitColdRuns++;
+
+	uint64_t before = vm->insCount;
+	RunResult result = vmInterpret(vm, count);
+	vm->jitColdIns += vm->insCount - before;
+	*left -= vm->insCount - before;
+	return result;
+}
+
+// Run at most budget instructions with the JIT. If the JIT can't be set up,
+// the interpreter is used.
+RunResult runJit(VM *vm, uint64_t budget) {
+	Jit *jit = vm->jit ? vm->jit : jitCreate(vm);
+	if (!jit) return vmInterpret(vm, budget);
+
+	uint64_t left = budget;
+
+	for (;;) {
+		if (!left) return RUN_BUDGET;
+
+		void *block = NULL;
+		if (vm->pc < 0x8000) {
+			block = jit->blocks[vm->pc];
+
+			if (!block && jit->hits[vm->pc] < vm->jitHot && vm->code[vm->pc].opcode < OP_COUNT) {
+				RunResult result = runCold(vm, jit, &left);
+				if (result != RUN_BUDGET) return result;
+				continue;
+			}
+			if (!block) block = compile(vm, jit, vm->pc);
+		}
+
+		if (!block) {
+			// Can't be translated, so it's an error. Let the interpreter
+			// report it.
+			RunResult result = vmInterpret(vm, 1);
+			if (result != RUN_BUDGET) return result;
+			left--;
+			continue;
+		}
+
+		int why = jit->enter(vm, block, left);
+		vm->insCount += left - jit->left;
+		left = jit->left;
+
+		switch (why) {
+			case EXIT_END: return RUN_END;
+			case EXIT_ERROR: return RUN_ERROR;
+
+			// The interpreter can stop in the middle of a block
+			case EXIT_BUDGET: return vmInterpret(vm, left);
+
+			case EXIT_STEP:
+				if (!vmExecute(vm)) return RUN_ERROR;
+				if (vm->needDraw) return RUN_END;
+				left--;
+				break;
+		}
+	}
+}
+
+#endif
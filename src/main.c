@@ -8,7 +8,12 @@
 #include "raylib.h"
 #include "ui.h"
 #include "vm.h"
+#include "host.h"
+#ifdef RECOMP
+	#include "recomp.h"
+#endif
 #include "sram.h"
+#include "rfxgen.h"
 
 #include "../assets/tileset.h"
 #include "../assets/icon.h"
@@ -22,6 +27,7 @@
 #endif
 
 VM *vm;
+Host host = {0};
 bool showFps = false;
 char message[33] = {0};
 u8 msgTime = 0;
@@ -32,25 +38,31 @@ Font font;
 
 #define GXA_YELLOW (Color) {255, 208, 64, 255}
 
+// Instructions a frame can run before the VM gives control back to the window
+// for a tick (a lag frame), and lag frames in a row before the program is
+// treated as stuck, about 5 seconds
+#define DEFAULT_BUDGET 1000000
+#define DEFAULT_WATCHDOG 300
+
+// Frames run before saving the screen with --png
+#define DEFAULT_PNG_FRAMES 60
+
 // _____________________________________________________________________________
 //
 //  Errors and Debugging
 // _____________________________________________________________________________
 //
-// Print an error message with a memory dump and exit.
-void err(const char *fmt, ...) {
-	char buf[256];
-	va_list args;
-	va_start(args, fmt);
-	vsprintf(buf, fmt, args);
-	va_end(args);
+// Show an error message with a memory dump and exit.
+void showError(const char *msg) {
+	char buf[320];
+	strcpy(buf, msg);
 
 	#ifndef PLATFORM_WEB
-		if (!vm->debug) {
+		if (!host.debug) {
 			strcat(buf, "\nTip: use --debug to get a memory dump");
 		} else {
-			char *dumpName = TextReplace(vm->fileName, GetFileExtension(vm->fileName), ".dmp");
-			char *regDumpName = TextReplace(vm->fileName, GetFileExtension(vm->fileName), ".regs.dmp");
+			char *dumpName = TextReplace(host.fileName, GetFileExtension(host.fileName), ".dmp");
+			char *regDumpName = TextReplace(host.fileName, GetFileExtension(host.fileName), ".regs.dmp");
 			SaveFileData(dumpName, vm->mem, 0x10000);
 			SaveFileData(regDumpName, vm->reg.data, 0x100);
 			free(dumpName);
@@ -68,6 +80,17 @@ void err(const char *fmt, ...) {
 	}
 }
 
+// Print an error message with a memory dump and exit.
+void err(const char *fmt, ...) {
+	char buf[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	showError(buf);
+}
+
 // Ask for an address and value to write to memory.
 // This has to be in a separate function so we can return to break out of both loops.
 void debugWrite(void) {
@@ -88,6 +111,9 @@ void debugWrite(void) {
 		if (errno != ERANGE) break;
 	}
 	vm->mem[addr] = val;
+
+	// ROM instructions are cached, decode them again if ROM was changed
+	if (addr < 0x8000) vmDecode(vm);
 }
 
 // Ask for an address and show its value to the user.
@@ -113,30 +139,254 @@ void debugRead(void) {
 	sprintf(message, __VA_ARGS__);\
 	msgTime = 0;
 
+// _____________________________________________________________________________
+//
+//  VM callbacks
+// _____________________________________________________________________________
+//
+// Draw calls are recorded and drawn when the frame is finished, see paintFrame()
+void addCall(Host *hst, DrawCall call) {
+	DrawList *list = &hst->lists[!hst->shown];
+
+	if (list->count == list->size) {
+		int size = list->size ? list->size*2 : 256;
+		DrawCall *calls = realloc(list->calls, size*sizeof(DrawCall));
+		if (!calls) {
+			err("Out of memory for draw calls");
+			return;
+		}
+		list->calls = calls;
+		list->size = size;
+	}
+
+	list->calls[list->count++] = call;
+}
+
+void onDraw(void *user, u8 sx, u8 sy, u8 w, u8 h, u8 x, u8 y) {
+	addCall(user, (DrawCall) {false, sx, sy, w, h, x, y});
+}
+
+void onClear(void *user, u8 sx, u8 sy, u8 w, u8 h, u8 x, u8 y) {
+	addCall(user, (DrawCall) {true, sx, sy, w, h, x, y});
+}
+
+// The VM gives the tilemap before any draw calls of the frame
+void onMap(void *user, const MapView *view) {
+	Host *hst = user;
+	DrawList *list = &hst->lists[!hst->shown];
+	list->map = true;
+	list->view = *view;
+}
+
+// The VM gives the sprites after the frame's draw calls
+void onSprites(void *user, const Sprite *sprites, int count) {
+	Host *hst = user;
+	DrawList *list = &hst->lists[!hst->shown];
+	memcpy(list->sprites, sprites, count*sizeof(Sprite));
+	list->spriteCount = count;
+}
+
+void onSound(void *user, u8 type, u8 freq, u8 sust, u8 decay) {
+	Host *hst = user;
+	UnloadSound(hst->curSound[type]);
+
+	WaveParams params = {0};
+	ResetWaveParams(&params);
+
+	params.waveTypeValue = type;
+	params.startFrequencyValue = (float) freq / 255;
+	params.sustainTimeValue = (float) sust / 255;
+	params.decayTimeValue = (float) decay / 255;
+
+	Wave wave = GenerateWave(params);
+	hst->curSound[type] = LoadSoundFromWave(wave);
+	PlaySound(hst->curSound[type]);
+
+	UnloadWave(wave);
+}
+
+void onInput(void *user, VMInput *input) {
+	Host *hst = user;
+	input->mouseX = GetMouseX() / hst->scale;
+	input->mouseY = GetMouseY() / hst->scale;
+	input->mouseL = IsMouseButtonDown(MOUSE_BUTTON_LEFT);
+	input->mouseR = IsMouseButtonDown(MOUSE_BUTTON_RIGHT);
+	input->up = IsKeyDown(KEY_UP) || IsKeyDown(KEY_W);
+	input->down = IsKeyDown(KEY_DOWN) || IsKeyDown(KEY_S);
+	input->left = IsKeyDown(KEY_LEFT) || IsKeyDown(KEY_A);
+	input->right = IsKeyDown(KEY_RIGHT) || IsKeyDown(KEY_D);
+	input->act[0] = IsKeyDown(KEY_J);
+	input->act[1] = IsKeyDown(KEY_K);
+	input->act[2] = IsKeyDown(KEY_L);
+}
+
+void onError(void *user, const char *msg) {
+	showError(msg);
+}
+
+// _____________________________________________________________________________
+//
+//  Frames
+// _____________________________________________________________________________
+//
+// Start recording the draw calls of a new frame.
+void beginFrame(void) {
+	DrawList *list = &host.lists[!host.shown];
+	list->count = 0;
+	list->keep = vm->keepScreen;
+	list->map = false;
+	list->spriteCount = 0;
+	list->clearX = vm->reg.clearX;
+	list->clearY = vm->reg.clearY;
+}
+
+// The frame being recorded is finished. Returns true if it looks different
+// from the one on the screen, it's then shown instead.
+bool finishFrame(void) {
+	DrawList *list = &host.lists[!host.shown];
+
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	hash = (hash ^ list->keep) * 1099511628211ULL;
+	hash = (hash ^ list->clearX) * 1099511628211ULL;
+	hash = (hash ^ list->clearY) * 1099511628211ULL;
+	hash = (hash ^ list->map) * 1099511628211ULL;
+	if (list->map) {
+		const u8 *bytes = (const u8 *) &list->view;
+		for (size_t i = 0; i < sizeof(MapView); i++) hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+	const u8 *bytes = (const u8 *) list->calls;
+	for (size_t i = 0; i < list->count*sizeof(DrawCall); i++) {
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+	bytes = (const u8 *) list->sprites;
+	for (size_t i = 0; i < list->spriteCount*sizeof(Sprite); i++) {
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+	list->hash = hash;
+
+	// The hash is checked first, most frames that changed stop there. With
+	// keep, drawing the same calls again changes nothing either: each pixel
+	// ends up as the last call that covers it left it.
+	const DrawList *shown = &host.lists[host.shown];
+	bool same = !host.stale && hash == shown->hash && list->keep == shown->keep
+		&& list->clearX == shown->clearX && list->clearY == shown->clearY
+		&& list->map == shown->map && (!list->map || !memcmp(&list->view, &shown->view, sizeof(MapView)))
+		&& list->count == shown->count
+		&& (!list->count || !memcmp(list->calls, shown->calls, list->count*sizeof(DrawCall)))
+		&& list->spriteCount == shown->spriteCount
+		&& !memcmp(list->sprites, shown->sprites, list->spriteCount*sizeof(Sprite));
+	if (same) return false;
+
+	host.shown = !host.shown;
+	host.stale = false;
+	return true;
+}
+
+// Draw the frame on the canvas, or into host.render->rgba with the software
+// renderer: fill it with the background pixel unless the frame keeps the
+// previous one, and run the draw calls.
+void paintFrame(void) {
+	const DrawList *list = &host.lists[host.shown];
+
+	if (host.render) {
+		if (!list->keep) renderClear(host.render, list->clearX, list->clearY);
+		if (list->map) renderMap(host.render, &list->view);
+		for (int i = 0; i < list->count; i++) {
+			const DrawCall *c = &list->calls[i];
+			if (c->fill) renderFill(host.render, c->sx, c->sy, c->w, c->h, c->x, c->y);
+			else renderDraw(host.render, c->sx, c->sy, c->w, c->h, c->x, c->y);
+		}
+		renderSprites(host.render, list->sprites, list->spriteCount);
+		renderPresent(host.render);
+		return;
+	}
+
+	BeginTextureMode(host.canvas);
+
+	// Transparent pixels leave the black background visible
+	if (!list->keep) {
+		ClearBackground(BLACK);
+		DrawTexturePro(
+			host.tileset,
+			(Rectangle) {list->clearX, list->clearY, 1, 1},
+			(Rectangle) {0, 0, SCREENW, SCREENH},
+			(Vector2) {0, 0}, 0.0f, WHITE
+		);
+	}
+
+	if (list->map) {
+		for (int row = 0; row < MAP_ROWS; row++) {
+			for (int col = 0; col < MAP_COLS; col++) {
+				u8 tile = list->view.tiles[row][col];
+				DrawTextureRec(
+					host.tileset, (Rectangle) {tile%16*8, tile/16*8, 8, 8},
+					(Vector2) {col*8 - list->view.fineX, row*8 - list->view.fineY}, WHITE
+				);
+			}
+		}
+	}
+
+	for (int i = 0; i < list->count; i++) {
+		const DrawCall *c = &list->calls[i];
+		if (c->fill) {
+			DrawRectangle(c->x, c->y, c->w, c->h, BLACK);
+			DrawTexturePro(
+				host.tileset,
+				(Rectangle) {c->sx, c->sy, 1, 1},
+				(Rectangle) {c->x, c->y, c->w, c->h},
+				(Vector2) {0, 0}, 0.0f, WHITE
+			);
+		} else {
+			DrawTextureRec(host.tileset, (Rectangle) {c->sx, c->sy, c->w, c->h}, (Vector2) {c->x, c->y}, WHITE);
+		}
+	}
+
+	// A negative source size mirrors the sprite
+	for (int i = 0; i < list->spriteCount; i++) {
+		const Sprite *s = &list->sprites[i];
+		Rectangle source = {
+			s->tile%16*8, s->tile/16*8,
+			(s->flags & SPR_FLIPX) ? -8 : 8, (s->flags & SPR_FLIPY) ? -8 : 8
+		};
+		DrawTextureRec(host.tileset, source, (Vector2) {s->x, s->y}, WHITE);
+	}
+
+	EndTextureMode();
+}
+
 // _____________________________________________________________________________
 //
 //  Loading/Unloading
 // _____________________________________________________________________________
 //
-// Load a ROM file and tileset from memory.
-void loadFileMem(u8 *file, unsigned int size, Image tileset) {
-	if (!file) err("Failed to load file");
-	if (size > 0x8000) err("ROM too large, 0x%.4X > 0x8000", size);
+// Give the tileset to the software renderer, if it's used.
+void loadSoftTileset(Image *tileset) {
+	if (!host.render) return;
 
-	if (file[0] != 'G' || file[1] != 'X' || file[2] != 'A') err("Invalid ROM file");
+	ImageFormat(tileset, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+	if (!renderSetTileset(host.render, tileset->data, tileset->width, tileset->height)) {
+		err("Invalid tileset, the software renderer needs at most 128 × 128 pixels and 16 colors, with no partial transparency");
+	}
+}
 
-	// Copy ROM into gxarch memory, clear rest of gxarch memory, load SRAM, init registers
-	memcpy(vm->rom, file, size);
-	for (int i = size; i < 0x10000; i++) vm->mem[i] = 0;
-	vm->state = ST_RUNNING;
-	load(vm);
+// Load a ROM file and tileset from memory.
+void loadFileMem(u8 *file, unsigned int size, Image tileset) {
+	if (!vmLoad(vm, file, size)) {
+		UnloadImage(tileset);
+		return;
+	}
+	loadSoftTileset(&tileset);
 
-	for (int i = 0; i < 64; i++) vm->reg.data[i] = 0;
-	vm->reg.rand = GetRandomValue(0, 0xFF);
-	vm->pc = get16(rom, 3);
+	#ifdef RECOMP
+		// Use the recompiled code that was built in if it's for this ROM
+		bool native = size == recompRomSize && !memcmp(file, recompRom, size);
+		vm->native = native ? recompRun : NULL;
+	#endif
 
-	vm->tileset = LoadTextureFromImage(tileset);
+	host.tileset = LoadTextureFromImage(tileset);
 	UnloadImage(tileset);
+	host.stale = true;
 
 	switch (speed) {
 		case 60: SetWindowTitle("gxVM - running"); break;
@@ -145,14 +395,8 @@ void loadFileMem(u8 *file, unsigned int size, Image tileset) {
 	}
 }
 
-// Load a ROM file and tileset, if found.
-void loadFile(char *name) {
-	strcpy(vm->fileName, name);
-
-	// Load ROM into memory
-	unsigned int size;
-	u8 *file = LoadFileData(name, &size);
-
+// Load the tileset for a ROM file.
+Image loadTileset(const char *name) {
 	Image tileset;
 
 	// Load tileset with the same filename as the ROM, for example:
@@ -196,22 +440,77 @@ void loadFile(char *name) {
 		tileset = LoadImageFromMemory(".png", tileset_png, tileset_png_len);
 	}
 
-	loadFileMem(file, size, tileset);
-	UnloadFileData(file);
 	free(imgName);
+	return tileset;
+}
+
+// Load a ROM file and tileset, if found.
+void loadFile(char *name) {
+	strcpy(host.fileName, name);
+
+	// Load ROM into memory
+	unsigned int size;
+	u8 *file = LoadFileData(name, &size);
+
+	loadFileMem(file, size, loadTileset(name));
+	UnloadFileData(file);
+}
+
+// Run the ROM without a window for the given number of frames with the
+// software renderer and save the screen as a PNG. Sound and input aren't used
+// and SRAM isn't saved. Returns the exit code.
+int savePng(const char *pngName, int frames) {
+	if (!fileFromArgv) {
+		TraceLog(LOG_ERROR, "--png needs a ROM file");
+		return EXIT_FAILURE;
+	}
+
+	vm->host.sound = NULL;
+	vm->host.input = NULL;
+	if (!host.render) host.render = calloc(1, sizeof(Render));
+	if (!host.render) return EXIT_FAILURE;
+
+	unsigned int size;
+	u8 *file = LoadFileData(host.fileName, &size);
+	bool loaded = vmLoad(vm, file, size);
+	UnloadFileData(file);
+	if (!loaded) return EXIT_FAILURE;
+
+	Image tileset = loadTileset(host.fileName);
+	loadSoftTileset(&tileset);
+	UnloadImage(tileset);
+
+	host.stale = true;
+	for (int i = 0; i < frames && vm->state == ST_RUNNING; i++) {
+		if (!vm->lagFrames) beginFrame();
+		if (vmRunFrame(vm) != RUN_BUDGET && finishFrame()) paintFrame();
+	}
+
+	Image screen = {
+		.data = host.render->rgba, .width = SCREENW, .height = SCREENH,
+		.mipmaps = 1, .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
+	};
+	return ExportImage(screen, pngName) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 // Unload everything and exit.
 // Note: won't get run on Web, SRAM saving on Web is done with Alt + S
 void cleanup() {
 	#ifndef PLATFORM_WEB
-		save(vm);
-
-		for (int i = 0; i < 4; i++) UnloadSound(vm->curSound[i]);
-		UnloadRenderTexture(vm->screen);
-		UnloadTexture(vm->tileset);
+		vmSave(vm);
+
+		for (int i = 0; i < 4; i++) UnloadSound(host.curSound[i]);
+		UnloadRenderTexture(host.screen);
+		UnloadRenderTexture(host.canvas);
+		UnloadTexture(host.tileset);
+		if (host.render) {
+			UnloadTexture(host.frame);
+			free(host.render);
+		}
+		free(host.lists[0].calls);
+		free(host.lists[1].calls);
 		UnloadFont(font);
-		free(vm);
+		vmDestroy(vm);
 
 		CloseWindow();
 		CloseAudioDevice();
@@ -224,10 +523,31 @@ void cleanup() {
 // _____________________________________________________________________________
 //
 void mainLoop(void);
+void drawMessages(void);
 
 int main(int argc, char **argv) {
-	vm = malloc(sizeof(VM));
-	if (vm == NULL) err("Failed to allocate virtual machine");
+	vm = vmCreate(&(VMHost) {
+		.user = &host,
+		.draw = onDraw,
+		.clear = onClear,
+		.map = onMap,
+		.sprites = onSprites,
+		.sound = onSound,
+		.input = onInput,
+		.loadSram = loadSram,
+		.saveSram = saveSram,
+		.error = onError
+	});
+
+	if (vm == NULL) {
+		TraceLog(LOG_ERROR, "Failed to allocate virtual machine");
+		exit(EXIT_FAILURE);
+	}
+	vm->budget = DEFAULT_BUDGET;
+	vm->watchdog = DEFAULT_WATCHDOG;
+
+	const char *pngName = NULL;
+	int pngFrames = DEFAULT_PNG_FRAMES;
 
 	#ifndef PLATFORM_WEB
 		for (int i = 1; i < argc; i++) {
@@ -236,7 +556,16 @@ int main(int argc, char **argv) {
 				puts("Usage: gxvm [options] [file]");
 				puts("-h, --help    Show this message");
 				puts("-d, --debug   Save memory dump on error");
-				puts("-n, --nosave  Don't create a .sav file\n");
+				puts("-n, --nosave  Don't create a .sav file");
+				puts("-t, --trace f Write a trace of executed instructions to f, view with gxtrace");
+				puts("-s, --seed N  Seed for the rand register, the same seed gives the same numbers");
+				puts("-j, --jit     Compile programs to x86-64 machine code, this is experimental");
+				puts("-H, --hot N   Run code N times before the JIT compiles it, 0 = right away");
+				puts("-b, --budget N Instructions per frame, the rest runs on the next one, 0 = no limit");
+				puts("-w, --watchdog N  Stop the program after N unfinished frames in a row, 0 = never");
+				puts("-c, --cpu     Draw on the CPU instead of the GPU, the picture is the same");
+				puts("-p, --png f   Run the ROM without a window and save the screen to f");
+				puts("-f, --frames N  Frames to run before saving the screen with --png (default 60)\n");
 				puts("Keybinds:");
 				puts("Ctrl + O      Open ROM");
 				puts("Ctrl + F      Show/hide FPS");
@@ -249,20 +578,44 @@ int main(int argc, char **argv) {
 				puts("Insert        Fast forward");
 				exit(EXIT_SUCCESS);
 			} else if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
-				vm->debug = true;
+				host.debug = true;
 			} else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--nosave")) {
-				vm->noSave = true;
+				host.noSave = true;
+			} else if ((!strcmp(argv[i], "-t") || !strcmp(argv[i], "--trace")) && i + 1 < argc) {
+				if (!vmTraceOpen(vm, argv[++i])) {
+					TraceLog(LOG_ERROR, "Failed to open trace file %s", argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if ((!strcmp(argv[i], "-s") || !strcmp(argv[i], "--seed")) && i + 1 < argc) {
+				vm->seed = strtoul(argv[++i], NULL, 0);
+			} else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jit")) {
+				vm->engine = ENGINE_JIT;
+			} else if ((!strcmp(argv[i], "-H") || !strcmp(argv[i], "--hot")) && i + 1 < argc) {
+				vm->jitHot = strtoul(argv[++i], NULL, 0);
+			} else if ((!strcmp(argv[i], "-b") || !strcmp(argv[i], "--budget")) && i + 1 < argc) {
+				vm->budget = strtoull(argv[++i], NULL, 0);
+			} else if ((!strcmp(argv[i], "-w") || !strcmp(argv[i], "--watchdog")) && i + 1 < argc) {
+				vm->watchdog = strtoul(argv[++i], NULL, 0);
+			} else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--cpu")) {
+				if (!host.render) host.render = calloc(1, sizeof(Render));
+				if (!host.render) exit(EXIT_FAILURE);
+			} else if ((!strcmp(argv[i], "-p") || !strcmp(argv[i], "--png")) && i + 1 < argc) {
+				pngName = argv[++i];
+			} else if ((!strcmp(argv[i], "-f") || !strcmp(argv[i], "--frames")) && i + 1 < argc) {
+				pngFrames = atoi(argv[++i]);
 			} else if (!strcmp(argv[i], "-dn") || !strcmp(argv[i], "-nd")) {
-				vm->debug = true;
-				vm->noSave = true;
+				host.debug = true;
+				host.noSave = true;
 			} else {
 				// We can't use loadFile() here because window is not initialized
 				// (we don't want to init window in case the arguments have --help)
 				// Instead, the filename string is checked before the main loop.
-				strcpy(vm->fileName, argv[i]);
+				strcpy(host.fileName, argv[i]);
 				fileFromArgv = true;
 			}
 		}
+
+		if (pngName) exit(savePng(pngName, pngFrames));
 	#endif
 
 // _____________________________________________________________________________
@@ -270,16 +623,16 @@ int main(int argc, char **argv) {
 //  Startup
 // _____________________________________________________________________________
 //
-	SetTraceLogLevel(vm->debug ? LOG_DEBUG : LOG_WARNING);
+	SetTraceLogLevel(host.debug ? LOG_DEBUG : LOG_WARNING);
 
 	#ifdef PLATFORM_WEB
 		// The web canvas fills the entire browser window, assume we're on at least 720p
-		vm->scale = 6;
+		host.scale = 6;
 	#else
-		vm->scale = 4;
+		host.scale = 4;
 	#endif
 
-	InitWindow(SCREENW*vm->scale, SCREENH*vm->scale, "gxVM");
+	InitWindow(SCREENW*host.scale, SCREENH*host.scale, "gxVM");
 	InitAudioDevice();
 	SetTargetFPS(speed);
 
@@ -293,7 +646,15 @@ int main(int argc, char **argv) {
 		SetWindowIcon(icon);
 	#endif
 
-	vm->screen = LoadRenderTexture(SCREENW, SCREENH);
+	host.screen = LoadRenderTexture(SCREENW, SCREENH);
+	host.canvas = LoadRenderTexture(SCREENW, SCREENH);
+	if (host.render) {
+		Image frame = {
+			.data = host.render->rgba, .width = SCREENW, .height = SCREENH,
+			.mipmaps = 1, .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
+		};
+		host.frame = LoadTextureFromImage(frame);
+	}
 
 	// Load the gxarch font, only used for messages and the fps display
 	Image fontImg = LoadImageFromMemory(".png", font_png, font_png_len);
@@ -302,7 +663,7 @@ int main(int argc, char **argv) {
 	atexit(cleanup);
 
 	// If a file was specified from command line args, load it
-	if (fileFromArgv) loadFile(vm->fileName);
+	if (fileFromArgv) loadFile(host.fileName);
 
 	#ifdef PLATFORM_WEB
 		else loadFileMem(
@@ -338,29 +699,29 @@ void mainLoop(void) {
 	}
 
 	if (IsKeyPressed(KEY_PAGE_UP)) {
-		vm->scale++;
-		SetWindowSize(SCREENW * vm->scale, SCREENH * vm->scale);
-		SHOWMSG("%d x %d", SCREENW * vm->scale, SCREENH * vm->scale);
+		host.scale++;
+		SetWindowSize(SCREENW * host.scale, SCREENH * host.scale);
+		SHOWMSG("%d x %d", SCREENW * host.scale, SCREENH * host.scale);
 	}
 
 	else if (IsKeyPressed(KEY_PAGE_DOWN)) {
-		vm->scale--;
-		if (!vm->scale) vm->scale = 1;
-		SetWindowSize(SCREENW * vm->scale, SCREENH * vm->scale);
-		SHOWMSG("%d x %d", SCREENW * vm->scale, SCREENH * vm->scale);
+		host.scale--;
+		if (!host.scale) host.scale = 1;
+		SetWindowSize(SCREENW * host.scale, SCREENH * host.scale);
+		SHOWMSG("%d x %d", SCREENW * host.scale, SCREENH * host.scale);
 	}
 
 	else if (IsKeyPressed(KEY_HOME)) {
-		if (vm->state == ST_IDLE || !strlen(vm->fileName)) {
+		if (vm->state == ST_IDLE || !strlen(host.fileName)) {
 			SHOWMSG("no program loaded");
 		} else {
-			loadFile(vm->fileName);
+			loadFile(host.fileName);
 			SHOWMSG("reset");
 		}
 	}
 
 	else if (IsKeyPressed(KEY_END)) {
-		if (vm->debug) err("User initiated error");
+		if (host.debug) err("User initiated error");
 		else exit(EXIT_SUCCESS);
 	}
 
@@ -432,9 +793,9 @@ void mainLoop(void) {
 		else if (IsKeyPressed(KEY_W)) debugWrite();
 
 		else if (IsKeyPressed(KEY_B)) {
-			vm->debug = !vm->debug;
-			SetTraceLogLevel(vm->debug ? LOG_DEBUG : LOG_WARNING);
-			SHOWMSG(vm->debug ? "debug on" : "debug off");
+			host.debug = !host.debug;
+			SetTraceLogLevel(host.debug ? LOG_DEBUG : LOG_WARNING);
+			SHOWMSG(host.debug ? "debug on" : "debug off");
 		}
 
 		// cleanup() is used to save SRAM and unload everything before the window
@@ -442,7 +803,7 @@ void mainLoop(void) {
 		#ifdef PLATFORM_WEB
 			else if (IsKeyPressed(KEY_S)) {
 				SHOWMSG("saved");
-				save(vm);
+				vmSave(vm);
 			}
 		#endif
 	}
@@ -452,29 +813,51 @@ void mainLoop(void) {
 //  Update and Draw
 // _____________________________________________________________________________
 //
-	BeginTextureMode(vm->screen);
-	if (vm->state != ST_PAUSED) {
-		ClearBackground(BLACK);
-		DrawTexturePro(
-			vm->tileset,
-			(Rectangle) {vm->reg.clearX, vm->reg.clearY, 1, 1},
-			(Rectangle) {0, 0, 192, 160},
-			(Vector2) {0, 0}, 0.0f, WHITE
-		);
+	// A lag frame continues recording the same frame this tick, the last
+	// finished frame stays on the screen until then
+	bool running = vm->state != ST_PAUSED;
+	if (running && !vm->lagFrames) beginFrame();
+	bool changed = vmRunFrame(vm) != RUN_BUDGET && running && finishFrame();
+
+	// A frame that looks like the one on the screen isn't drawn again, the
+	// canvas still has it
+	if (changed) {
+		paintFrame();
+		if (host.render) UpdateTexture(host.frame, host.render->rgba);
 	}
 
-	switch (vm->state) {
-		case ST_RUNNING:
-			while (!vm->needDraw) step(vm);
-			// fall through
+	// Messages are drawn on top of the canvas, so the screen is only put
+	// together again while one is shown and once more to remove it
+	bool overlay = msgTime < speed || showFps;
+	if (changed || overlay || host.overlay) {
+		BeginTextureMode(host.screen);
+		if (host.render) {
+			DrawTexture(host.frame, 0, 0, WHITE);
+		} else {
+			DrawTextureRec(host.canvas.texture, (Rectangle) {0, 0, SCREENW, -SCREENH}, (Vector2) {0, 0}, WHITE);
+		}
+		drawMessages();
+		EndTextureMode();
+	}
+	host.overlay = overlay;
 
-		case ST_PAUSED:
-			vm->needDraw = false;
-			break;
+	// raylib polls input and waits for the next frame in EndDrawing(), so the
+	// window is still presented every tick, but that's only one texture draw
+	BeginDrawing();
+	ClearBackground(BLACK);
 
-		case ST_IDLE: break;
-	}
+	DrawTexturePro(
+		host.screen.texture,
+		(Rectangle){0, 0, SCREENW, -SCREENH},
+		(Rectangle){0, 0, GetScreenWidth(), GetScreenHeight()},
+		(Vector2){0, 0}, 0.0f, WHITE
+	);
+
+	EndDrawing();
+}
 
+// Draw the message and the FPS counter on the screen, if they are shown.
+void drawMessages(void) {
 	// Show message for 1 second
 	if (msgTime < speed) {
 		// Draw a thick black outline with yellow text in the middle
@@ -496,18 +879,4 @@ void mainLoop(void) {
 		}
 		DrawTextEx(font, fps, (Vector2) {1, 152}, 8, 0, GXA_YELLOW);
 	}
-
-	EndTextureMode();
-
-	BeginDrawing();
-	ClearBackground(BLACK);
-
-	DrawTexturePro(
-		vm->screen.texture,
-		(Rectangle){0, 0, SCREENW, -SCREENH},
-		(Rectangle){0, 0, GetScreenWidth(), GetScreenHeight()},
-		(Vector2){0, 0}, 0.0f, WHITE
-	);
-
-	EndDrawing();
 }
\ No newline at end of file
@@ -0,0 +1,52 @@
+#include "recomp.h"
+
+// Leave the recompiled code, recompRunFrame() returns result
+u16 recompStop(RecompCtx *c, RunResult result, u16 pc) {
+	c->stop = true;
+	c->result = result;
+	return pc;
+}
+
+// Run an instruction that causes an error with vmExecute(), which reports it,
+// or one that wasn't recompiled. STEP() has already taken the budget for it.
+u16 recompFail(VM *vm, RecompCtx *c, u16 pc) {
+	vm->pc = pc;
+	if (c->rngAddr == pc) vm->rng = c->rng;
+	c->counted++;
+	if (!vmExecute(vm)) return recompStop(c, RUN_ERROR, pc);
+	if (vm->needDraw) return recompStop(c, RUN_END, vm->pc);
+	return vm->pc;
+}
+
+// Run at most budget instructions with the recompiled functions. funcs has
+// the function to call for each instruction address.
+RunResult recompRunFrame(VM *vm, uint64_t budget, const RecompFunc *funcs) {
+	RecompCtx c = {.left = budget};
+	u16 pc = vm->pc;
+
+	while (!c.stop) {
+		if (pc < 0x8000 && funcs[pc]) {
+			pc = funcs[pc](vm, pc, &c);
+			continue;
+		}
+
+		// Not found when recompiling, for example only reached by a jump to an
+		// address in registers
+		if (!c.left) {
+			recompStop(&c, RUN_BUDGET, pc);
+			break;
+		}
+
+		vm->pc = pc;
+		c.left--;
+		c.counted++;
+
+		RunResult result = vmInterpret(vm, 1);
+		if (result != RUN_BUDGET) recompStop(&c, result, vm->pc);
+		pc = vm->pc;
+	}
+
+	vm->pc = pc;
+	vm->insCount += budget - c.left - c.counted;
+	return c.result;
+}
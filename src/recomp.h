@@ -0,0 +1,107 @@
+#ifndef RECOMP_H
+#define RECOMP_H
+
+// _____________________________________________________________________________
+//
+//  Runtime for ROMs recompiled to C by gxrecomp
+// _____________________________________________________________________________
+//
+// gxrecomp turns every function of a ROM (the entry point and every CALL
+// target) into a C function. A recompiled function is given the address to
+// start at, runs until it leaves the function (return, jumps and calls it
+// can't follow, SYS_END, errors, running out of budget) and returns the
+// address to continue at. recompRunFrame() keeps calling the function for
+// that address, code that wasn't found when recompiling is interpreted.
+//
+// The generated code has the same behavior as the interpreter, including the
+// rand register's numbers and stopping exactly when the budget runs out.
+// Instructions that cause errors are given to vmExecute(), which reports the
+// error, and so are instructions that could read the rand register more than
+// once, because C doesn't fix the order the operands are read in.
+//
+#include "vm.h"
+
+// Calls between recompiled functions are C calls up to this depth, deeper
+// calls return to recompRunFrame() so recursive programs can't overflow the
+// C stack
+#define RECOMP_MAXDEPTH 64
+
+typedef struct RecompCtx {
+	uint64_t left;     // instruction budget left
+	uint64_t counted;  // instructions already added to vm->insCount
+	uint32_t rng;      // vm->rng before the instruction at rngAddr, see STEPR()
+	u16 rngAddr;
+	int depth;
+	bool stop;
+	RunResult result;
+} RecompCtx;
+
+typedef u16 (*RecompFunc)(VM *vm, u16 pc, RecompCtx *c);
+
+RunResult recompRunFrame(VM *vm, uint64_t budget, const RecompFunc *funcs);
+u16 recompStop(RecompCtx *c, RunResult result, u16 pc);
+u16 recompFail(VM *vm, RecompCtx *c, u16 pc);
+
+// Defined by the generated code
+extern const u8 recompRom[];
+extern const unsigned int recompRomSize;
+RunResult recompRun(VM *vm, uint64_t budget);
+
+// Start of the instruction at addr
+#define STEP(addr) \
+	if (!c->left) return recompStop(c, RUN_BUDGET, addr); \
+	c->left--;
+
+// Start of an instruction that can read the rand register. If it fails after
+// that, recompFail() puts the generator back before running it again.
+#define STEPR(addr) \
+	STEP(addr); \
+	c->rng = vm->rng; \
+	c->rngAddr = addr;
+
+// Read a register only known at runtime, %62 gets a new random number
+#define READ(reg) vmReadReg(vm, reg)
+
+// The instruction at addr causes an error, or can't be recompiled
+#define FAIL(addr) return recompFail(vm, c, addr)
+
+#define SETREG(addr, reg, val) { \
+	u8 reg_ = reg; \
+	if (reg_ > 63) FAIL(addr); \
+	r[reg_] = val; \
+}
+
+// Call a recompiled function with enter (vmCall() or vmCallFast()), continue
+// at label if it returns to next
+#define CALL(enter, target, func, next, label) { \
+	vm->pc = next; \
+	enter(vm, target); \
+	if (c->depth >= RECOMP_MAXDEPTH) return target; \
+	c->depth++; \
+	pc = func(vm, target, c); \
+	c->depth--; \
+	if (pc == next && !c->stop) goto label; \
+	return pc; \
+}
+
+// Call an address only known at runtime
+#define CALLPTR(enter, target, next) { \
+	u16 target_ = target; \
+	vm->pc = next; \
+	enter(vm, target_); \
+	return target_; \
+}
+
+// Return with leave (vmReturn() or vmReturnFast())
+#define RETURN(leave) { \
+	leave(vm); \
+	return vm->pc; \
+}
+
+#define SYS(addr, call, next) { \
+	vm->pc = next; \
+	if (!vmSyscall(vm, call)) return recompStop(c, RUN_ERROR, addr); \
+	if (vm->needDraw) return recompStop(c, RUN_END, next); \
+}
+
+#endif // recomp.h
@@ -0,0 +1,167 @@
+#include "render.h"
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+// Load the tileset from RGBA pixels. Returns false if it's larger than
+// 128 × 128, has more than 16 colors, or has partly transparent pixels: the
+// mask can't blend them like raylib does, so those tilesets are rejected
+// instead of drawn differently. Fully transparent pixels are all one color,
+// whatever their RGB values are.
+bool renderSetTileset(Render *r, const u8 *rgba, int width, int height) {
+	if (width < 1 || height < 1 || width > TILESET_SIZE || height > TILESET_SIZE) return false;
+
+	r->width = width;
+	r->height = height;
+	r->colors = 0;
+	u8 colors[PALETTE_SIZE][4];
+	static const u8 transparent[4] = {0};
+
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			const u8 *pixel = &rgba[(y*width + x)*4];
+			if (pixel[3] && pixel[3] != 255) return false;
+			if (!pixel[3]) pixel = transparent;
+
+			int i = 0;
+			while (i < r->colors && memcmp(colors[i], pixel, 4)) i++;
+			if (i == r->colors) {
+				if (r->colors == PALETTE_SIZE) return false;
+				memcpy(colors[r->colors++], pixel, 4);
+			}
+
+			r->tiles[y*TILESET_SIZE + x] = i;
+			r->mask[y*TILESET_SIZE + x] = pixel[3] ? 0xFF : 0x00;
+		}
+	}
+
+	for (int i = 0; i < r->colors; i++) {
+		memcpy(r->palette[i], colors[i], 3);
+		r->palette[i][3] = 255;
+	}
+	return true;
+}
+
+// Fill the screen with the tileset's pixel at x, y (the clearX and clearY
+// registers).
+void renderClear(Render *r, u8 x, u8 y) {
+	memset(r->screen, r->tiles[(y % r->height)*TILESET_SIZE + x % r->width], sizeof(r->screen));
+}
+
+// Fill the w × h area at x, y with the tileset's pixel at sx, sy, like
+// SYS_CLEAR. The area is cut off at the edges of the screen.
+void renderFill(Render *r, u8 sx, u8 sy, u8 w, u8 h, u8 x, u8 y) {
+	if (x >= SCREENW || y >= SCREENH) return;
+	int cols = (x + w > SCREENW) ? SCREENW - x : w;
+	int rows = (y + h > SCREENH) ? SCREENH - y : h;
+	u8 color = r->tiles[(sy % r->height)*TILESET_SIZE + sx % r->width];
+
+	for (int j = 0; j < rows; j++) memset(&r->screen[(y + j)*SCREENW + x], color, cols);
+}
+
+// Copy the opaque pixels of a row, 16 at a time with SSE2
+static inline void copyRow(u8 *dst, const u8 *src, const u8 *mask, int len) {
+	int i = 0;
+
+	#ifdef __SSE2__
+		for (; i + 16 <= len; i += 16) {
+			__m128i s = _mm_loadu_si128((const __m128i *) &src[i]);
+			__m128i m = _mm_loadu_si128((const __m128i *) &mask[i]);
+			__m128i d = _mm_loadu_si128((const __m128i *) &dst[i]);
+			d = _mm_or_si128(_mm_and_si128(m, s), _mm_andnot_si128(m, d));
+			_mm_storeu_si128((__m128i *) &dst[i], d);
+		}
+	#endif
+
+	for (; i < len; i++) dst[i] = (src[i] & mask[i]) | (dst[i] & ~mask[i]);
+}
+
+// Draw the w × h area of the tileset at sx, sy to x, y on the screen. The area
+// wraps around the tileset and is cut off at the edges of the screen, x and y
+// can be negative.
+static void blit(Render *r, int sx, int sy, int w, int h, int x, int y) {
+	if (x < 0) {
+		sx -= x;
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		sy -= y;
+		h += y;
+		y = 0;
+	}
+	if (x >= SCREENW || y >= SCREENH) return;
+	int cols = (x + w > SCREENW) ? SCREENW - x : w;
+	int rows = (y + h > SCREENH) ? SCREENH - y : h;
+
+	for (int j = 0; j < rows; j++) {
+		u8 *dst = &r->screen[(y + j)*SCREENW + x];
+		int row = ((sy + j) % r->height)*TILESET_SIZE;
+		int col = sx % r->width;
+
+		// Split the row where it wraps around the tileset
+		for (int done = 0; done < cols;) {
+			int len = r->width - col;
+			if (len > cols - done) len = cols - done;
+
+			copyRow(&dst[done], &r->tiles[row + col], &r->mask[row + col], len);
+			done += len;
+			col = 0;
+		}
+	}
+}
+
+// Draw like SYS_DRAW.
+void renderDraw(Render *r, u8 sx, u8 sy, u8 w, u8 h, u8 x, u8 y) {
+	blit(r, sx, sy, w, h, x, y);
+}
+
+// Draw the visible part of the tilemap, see MapView.
+void renderMap(Render *r, const MapView *view) {
+	for (int row = 0; row < MAP_ROWS; row++) {
+		for (int col = 0; col < MAP_COLS; col++) {
+			u8 tile = view->tiles[row][col];
+			blit(r, tile%16*8, tile/16*8, 8, 8, col*8 - view->fineX, row*8 - view->fineY);
+		}
+	}
+}
+
+// Draw sprites in the order given, see Sprite.
+void renderSprites(Render *r, const Sprite *sprites, int count) {
+	for (int i = 0; i < count; i++) {
+		const Sprite *s = &sprites[i];
+		int sx = s->tile%16*8, sy = s->tile/16*8;
+		bool flipX = s->flags & SPR_FLIPX;
+		bool flipY = s->flags & SPR_FLIPY;
+
+		if (!flipX && !flipY) {
+			blit(r, sx, sy, 8, 8, s->x, s->y);
+			continue;
+		}
+
+		// Mirrored sprites are drawn a pixel at a time
+		for (int j = 0; j < 8; j++) {
+			int y = s->y + j;
+			if (y < 0 || y >= SCREENH) continue;
+			int row = ((sy + (flipY ? 7 - j : j)) % r->height)*TILESET_SIZE;
+
+			for (int k = 0; k < 8; k++) {
+				int x = s->x + k;
+				if (x < 0 || x >= SCREENW) continue;
+				int src = row + (sx + (flipX ? 7 - k : k)) % r->width;
+				if (r->mask[src]) r->screen[y*SCREENW + x] = r->tiles[src];
+			}
+		}
+	}
+}
+
+// Turn the screen into RGBA in r->rgba.
+void renderPresent(Render *r) {
+	uint32_t colors[PALETTE_SIZE];
+	memcpy(colors, r->palette, sizeof(colors));
+
+	for (int i = 0; i < SCREENW*SCREENH; i++) {
+		memcpy(&r->rgba[i*4], &colors[r->screen[i]], 4);
+	}
+}
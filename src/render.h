@@ -0,0 +1,48 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+// _____________________________________________________________________________
+//
+//  Software renderer
+// _____________________________________________________________________________
+//
+// Draws the screen on the CPU into a framebuffer of palette indices, so ROMs
+// can run and be shown without a GPU, and gives the same picture as drawing
+// with raylib. The tileset is turned into palette indices once when it's
+// loaded, SYS_DRAW copies rows of indices with a mask for the transparent
+// pixels, and the framebuffer is turned into RGBA once per frame. Pixels are
+// either opaque or fully transparent, tilesets with partial alpha are left to
+// raylib.
+//
+#include "vm.h"
+
+#define TILESET_SIZE 128
+#define PALETTE_SIZE 16
+
+typedef struct Render {
+	// Tileset as palette indices, with a mask that is 0xFF for every opaque
+	// pixel. Rows are TILESET_SIZE long even if the image is smaller, reads
+	// wrap around at the image's size like the GPU's texture does.
+	u8 tiles[TILESET_SIZE*TILESET_SIZE];
+	u8 mask[TILESET_SIZE*TILESET_SIZE];
+	int width, height;
+
+	// Colors of the tileset as RGBA bytes, transparent colors are black: they
+	// only end up on the screen when clearing with them, which leaves the
+	// black window background visible
+	u8 palette[PALETTE_SIZE][4];
+	int colors;
+
+	u8 screen[SCREENW*SCREENH];      // palette indices
+	u8 rgba[SCREENW*SCREENH*4];      // the screen after renderPresent()
+} Render;
+
+bool renderSetTileset(Render *r, const u8 *rgba, int width, int height);
+void renderClear(Render *r, u8 x, u8 y);
+void renderDraw(Render *r, u8 sx, u8 sy, u8 w, u8 h, u8 x, u8 y);
+void renderFill(Render *r, u8 sx, u8 sy, u8 w, u8 h, u8 x, u8 y);
+void renderMap(Render *r, const MapView *view);
+void renderSprites(Render *r, const Sprite *sprites, int count);
+void renderPresent(Render *r);
+
+#endif // render.h
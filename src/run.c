@@ -0,0 +1,116 @@
+#include "vm.h"
+
+// _____________________________________________________________________________
+//
+//  Frame loops
+// _____________________________________________________________________________
+//
+// See interp.h. The computed goto version needs GCC or Clang, other compilers
+// only get the switch version.
+#define THREADED 0
+#define RUNFRAME runSwitch
+#include "interp.h"
+#undef THREADED
+#undef RUNFRAME
+
+#ifdef __GNUC__
+	#define HAS_THREADED
+	#define THREADED 1
+	#define RUNFRAME runThreaded
+	#include "interp.h"
+	#undef THREADED
+	#undef RUNFRAME
+#endif
+
+// Run one instruction at a time with step(), used when tracing.
+static RunResult runStep(VM *vm, uint64_t budget) {
+	while (!vm->needDraw) {
+		if (!budget--) return RUN_BUDGET;
+		step(vm);
+	}
+
+	return vm->state == ST_RUNNING ? RUN_END : RUN_ERROR;
+}
+
+// Run at most budget instructions with the fastest interpreter. Used by the
+// JIT for anything it doesn't translate.
+RunResult vmInterpret(VM *vm, uint64_t budget) {
+	#ifdef HAS_THREADED
+		return runThreaded(vm, budget);
+	#else
+		return runSwitch(vm, budget);
+	#endif
+}
+
+// Instructions stepped through to find where a stuck program is looping
+#define WATCHDOG_STEPS 1000
+
+// Run instructions until the program finishes drawing a frame (SYS_END), an
+// error occurs or vm->budget instructions have been run. If the budget ran out,
+// the next call continues the same frame, see VM.lagFrames.
+RunResult vmRunFrame(VM *vm) {
+	if (vm->state != ST_RUNNING) return RUN_ERROR;
+
+	Engine engine = vm->engine;
+	if (vm->traceFile) engine = ENGINE_STEP;
+
+	if (engine == ENGINE_AUTO && vm->native) engine = ENGINE_NATIVE;
+
+	#ifdef HAS_THREADED
+		if (engine == ENGINE_AUTO) engine = ENGINE_THREADED;
+	#else
+		if (engine == ENGINE_AUTO || engine == ENGINE_THREADED) engine = ENGINE_SWITCH;
+	#endif
+
+	uint64_t budget = vm->budget ? vm->budget : UINT64_MAX;
+	RunResult result;
+
+	switch (engine) {
+		#ifdef HAS_THREADED
+			case ENGINE_THREADED: result = runThreaded(vm, budget); break;
+		#endif
+		case ENGINE_SWITCH: result = runSwitch(vm, budget); break;
+		case ENGINE_JIT: result = runJit(vm, budget); break;
+		case ENGINE_NATIVE:
+			result = vm->native ? vm->native(vm, budget) : vmInterpret(vm, budget);
+			break;
+		default: result = runStep(vm, budget); break;
+	}
+
+	vm->needDraw = false;
+
+	if (result != RUN_BUDGET) {
+		vm->lagFrames = 0;
+		return result;
+	}
+	// Counted even without a watchdog, the host uses it to tell lag frames
+	// from new ones
+	vm->lagFrames++;
+	if (!vm->watchdog || vm->lagFrames < vm->watchdog) return result;
+
+	// The program looks stuck, step through it for a while to find the
+	// addresses it keeps running
+	u16 low = vm->pc, high = vm->pc;
+	for (int i = 0; i < WATCHDOG_STEPS && vm->state == ST_RUNNING && !vm->needDraw; i++) {
+		step(vm);
+		if (vm->pc < low) low = vm->pc;
+		if (vm->pc > high) high = vm->pc;
+	}
+
+	// vmError() also sets needDraw, so check the state first
+	if (vm->state != ST_RUNNING) {
+		vm->needDraw = false;
+		return RUN_ERROR;
+	}
+	if (vm->needDraw) {
+		vm->needDraw = false;
+		vm->lagFrames = 0;
+		return RUN_END;
+	}
+	vmError(
+		vm, "Frame not finished after %u lag frames, stuck at 0x%.4X-0x%.4X",
+		vm->lagFrames, low, high
+	);
+	vm->needDraw = false;
+	return RUN_ERROR;
+}
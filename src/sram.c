@@ -1,6 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
-#include "vm.h"
+#include "sram.h"
 void err(const char *fmt, ...);
 
 #ifdef PLATFORM_WEB
@@ -13,13 +13,13 @@ void err(const char *fmt, ...);
 #endif
 
 // Saves SRAM data to a file. localStorage is used on Web instead.
-void save(VM *vm) {
+void saveSram(void *user, const u8 *sram) {
 	#ifdef PLATFORM_WEB
 		char script[16384 + 128] = "[";
 		char num[4];
 
 		for (int i = 0; i < 0x1000; i++) {
-			sprintf(num, "%d", vm->sram[i]);
+			sprintf(num, "%d", sram[i]);
 			strcat(script, num);
 			strcat(script, ",");
 		}
@@ -27,35 +27,35 @@ void save(VM *vm) {
 		strcat(script, TextFormat("].forEach((b, i) => localStorage.setItem(`%s_${i}`, b))", getfilename()));
 		emscripten_run_script(script);
 	#else
-		if (vm->noSave) return;
-		char *saveName = TextReplace(vm->fileName, GetFileExtension(vm->fileName), ".sav");
+		Host *host = user;
+		if (host->noSave) return;
+		char *saveName = TextReplace(host->fileName, GetFileExtension(host->fileName), ".sav");
 
 		// If SRAM is blank and save file doesn't exist, no point in saving
 		bool needSave = false;
 		for (int i = 0; i < 0x1000; i++) {
-			if (vm->sram[i]) {
+			if (sram[i]) {
 				needSave = true;
 				break;
 			}
 		}
 
-		if (needSave || FileExists(saveName)) SaveFileData(saveName, vm->sram, 0x1000);
+		if (needSave || FileExists(saveName)) SaveFileData(saveName, (u8 *) sram, 0x1000);
 		free(saveName);
 	#endif
 }
 
 // Loads SRAM data from a file.
-void load(VM *vm) {
-	if (vm->state == ST_IDLE) return;
-	
+void loadSram(void *user, u8 *sram) {
 	#ifdef PLATFORM_WEB
 		for (int i = 0; i < 0x1000; i++) {
-			vm->sram[i] = emscripten_run_script_int(
+			sram[i] = emscripten_run_script_int(
 				TextFormat("parseInt(localStorage.getItem('%s_%d'))", getfilename(), i));
 		}
 	#else
-		if (vm->noSave) return;
-		char *saveName = TextReplace(vm->fileName, GetFileExtension(vm->fileName), ".sav");
+		Host *host = user;
+		if (host->noSave) return;
+		char *saveName = TextReplace(host->fileName, GetFileExtension(host->fileName), ".sav");
 		if (!FileExists(saveName)) return;
 
 		unsigned int size;
@@ -64,7 +64,7 @@ void load(VM *vm) {
 		if (!data) err("Failed to load file");
 		if (size > 0x1000) err("Save file too large, 0x%.4X > 0x1000", size);
 
-		memcpy(vm->sram, data, 0x1000);
+		memcpy(sram, data, 0x1000);
 		UnloadFileData(data);
 	#endif
 }
\ No newline at end of file
@@ -1,9 +1,9 @@
 #ifndef SRAM_H
 #define SRAM_H
 
-#include "vm.h"
+#include "host.h"
 
-void save(VM *vm);
-void load(VM *vm);
+void saveSram(void *user, const u8 *sram);
+void loadSram(void *user, u8 *sram);
 
-#endif // sram.h
\ No newline at end of file
+#endif // sram.h
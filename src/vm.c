@@ -1,7 +1,6 @@
 #include "vm.h"
-#include "sram.h"
-#include "rfxgen.h"
-void err(const char *fmt, ...); // main.c
+#include <stdarg.h>
+#include <time.h>
 
 // Opcode names, used for debugging.
 const char *opnames[] = {
@@ -12,89 +11,872 @@ const char *opnames[] = {
 	"eqj  ", "ltj  ", "gtj  ",
 	"eqc  ", "ltc  ", "gtc  ",
 	"arg  ", "jmp  ", "cj   ", "call ", "cc   ", "ret  ", "retv ",
-	"sys  "
+	"sys  ", "callf", "retf ",
+	"ext  ", "argn ", "ldx  ", "stx  ",
+	"shl  ", "shr  ", "rol  ", "ror  "
 };
 
 // Syscall names, used for debugging.
 const char *sysnames[] = {
-	"(draw)", "(end)", "(sound)"
+	"(draw)", "(end)", "(sound)", "(math)",
+	"(memcpy)", "(memset)", "(memcmp)", "(keep)", "(clear)",
+	"(map)", "(sprites)"
 };
 
-void call(VM *vm, u16 addr) {
-	u8 temp[8];
+// Operand formats of each opcode. v = value, or register if the pointer flag is
+// set, a = address, or register pair if the pointer flag is set, c = condition
+// register, its value is a register if the pointer flag is set, o = offset
+// register added to the address, incremented afterwards if the pointer flag is
+// set. The pointer flags are given to the operands in order. ARGN's operands
+// are decoded separately, see decode().
+const char *opformats[] = {
+	"", "vv", "va", "va",
+	"vvv", "vvv", "vvv", "vvv", "vvv",
+	"vvv", "vvv", "vvv",
+	"vvv", "vvv", "vvv",
+	"vva", "vva", "vva",
+	"vva", "vva", "vva",
+	"v", "a", "ca", "a", "ca", "", "v",
+	"v", "a", "",
+	"", "", "vao", "vao",
+	"vvv", "vvv", "vvv", "vvv"
+};
 
-	for (int i = 0; i < 8; i++) {
-		temp[i] = vm->reg.args[i];
-		vm->reg.args[i] = vm->argStack[vm->sp][i];
-		vm->argStack[vm->sp][i] = temp[i];
-		vm->localStack[vm->sp][i] = vm->reg.local[i];
-		vm->reg.local[i] = 0;
+// Superinstruction names, used for debugging.
+const char *fusenames[] = {
+	"add16", "addltj", "argsys"
+};
+
+// _____________________________________________________________________________
+//
+//  Creating and loading
+// _____________________________________________________________________________
+//
+// Allocate a new virtual machine. The host callbacks are copied, so the
+// VMHost struct doesn't need to stay alive. Returns NULL if out of memory.
+VM *vmCreate(const VMHost *host) {
+	VM *vm = calloc(1, sizeof(VM));
+	if (vm == NULL) return NULL;
+
+	if (host) vm->host = *host;
+	vm->seed = time(NULL);
+	vm->jitHot = JIT_HOT;
+	return vm;
+}
+
+// Load a ROM file into the virtual machine and reset it.
+bool vmLoad(VM *vm, const u8 *file, unsigned int size) {
+	if (!file) {
+		vmError(vm, "Failed to load file");
+		return false;
+	}
+	if (size > 0x8000) {
+		vmError(vm, "ROM too large, 0x%.4X > 0x8000", size);
+		return false;
+	}
+	if (size < 5 || file[0] != 'G' || file[1] != 'X' || file[2] != 'A') {
+		vmError(vm, "Invalid ROM file");
+		return false;
 	}
 
-	vm->callStack[vm->sp++] = vm->pc;
-	vm->pc = addr;
+	// Copy ROM into gxarch memory, clear rest of gxarch memory, load SRAM, init registers
+	memcpy(vm->rom, file, size);
+	for (int i = size; i < 0x10000; i++) vm->mem[i] = 0;
+	vm->state = ST_RUNNING;
+	if (vm->host.loadSram) vm->host.loadSram(vm->host.user, vm->sram);
+
+	for (int i = 0; i < 64; i++) vm->reg.data[i] = 0;
+
+	// Mix the seed so similar seeds give different numbers, xorshift gets
+	// stuck at 0
+	vm->rng = vm->seed*2654435769u + 0x7F4A7C15;
+	if (!vm->rng) vm->rng = 1;
+	vm->pc = get16(rom, 3);
+	vm->sp = 0;
 	vm->argsp = 0;
+	vm->needDraw = false;
+	vm->keepScreen = false;
+	memset(&vm->map, 0, sizeof(vm->map));
+	memset(&vm->sprites, 0, sizeof(vm->sprites));
+	vm->frame = 0;
+	vm->insCount = 0;
+	vm->lagFrames = 0;
+	vm->idleFrames = 0;
+	memset(vm->fuseCount, 0, sizeof(vm->fuseCount));
+	vm->jitBlocks = 0;
+	vm->jitColdBlocks = 0;
+	vm->jitColdRuns = 0;
+	vm->jitColdIns = 0;
+
+	vmDecode(vm);
+	return true;
 }
 
-void step(VM *vm) {
-	u16 startPC = vm->pc;
-	
-	if (vm->pc < 0x0005 || vm->pc > 0x7FFF) {
-		err("Attempted to execute code at 0x%.4X", startPC);
-		return;
+// Check the operands of a decoded instruction that are known before running
+// it: register numbers must be below 64, including registers used as pointers,
+// a register pair used as an address must start below 63, and immediate LD/ST
+// addresses must be readable/writable. Registers that are
+// read through a pointer are only known at runtime, the frame loops still
+// check those. An instruction that fails this always causes an error, so the
+// frame loops only run instructions that pass it, without the checks.
+static bool verify(const VM *vm, const Insn *ins) {
+	if (ins->opcode == OP_ARGN) {
+		for (int i = 0; i < ins->arg[0]; i++) {
+			if ((ins->arg[1] & (0b10000000 >> i)) && vm->mem[ins->addr + i] > 63) return false;
+		}
+		return true;
 	}
 
-	u8 opByte = consume();
-	u8 op = opByte & 0b00011111;
+	// Operand that is a register number, not a value
+	int dest = -1;
+	switch (ins->opcode) {
+		case OP_SET: case OP_LD: case OP_ST: case OP_LDX: case OP_STX:
+			dest = 0;
+			break;
+	}
+	if (ins->opcode >= OP_ADD && ins->opcode <= OP_GT) dest = 2;
+	if (ins->opcode >= OP_SHL && ins->opcode <= OP_ROR) dest = 2;
 
-	if (op >= OP_COUNT) {
-		err("Invalid opcode at 0x%.4X: %d", startPC, op);
+	int flag = 0;
+	int argn = 0;
+
+	for (const char *f = opformats[ins->opcode]; *f; f++) {
+		bool ptr = ins->op & (0b10000000 >> flag++);
+		if (*f == 'a') {
+			if (ptr && ins->addr > 62) return false;
+			continue;
+		}
+
+		if ((ptr || *f == 'c' || *f == 'o' || argn == dest) && ins->arg[argn] > 63) return false;
+		argn++;
+	}
+
+	if (!(ins->op & 0b01000000)) {
+		if (ins->opcode == OP_LD && ins->addr > 0x7FFF && ins->addr < 0xE000) return false;
+		if (ins->opcode == OP_ST && ins->addr < 0xE000) return false;
+	}
+	return true;
+}
+
+// Decode the instruction at addr into the instruction cache.
+static void decode(VM *vm, u16 addr) {
+	Insn *ins = &vm->code[addr];
+	u16 pc = addr;
+
+	*ins = (Insn) {0};
+	ins->op = vm->mem[pc++];
+	u8 op = ins->op & 0b00011111;
+
+	if (addr < 0x0005) {
+		ins->opcode = ins->handler = H_BADPC;
+		return;
+	}
+	ins->handler = ins->op;
+
+	// Extended opcodes have one handler for all of the flags
+	if (op == OP_EXT) {
+		u16 ext = vm->mem[pc++] + OP_EXT + 1;
+		if (ext >= OP_COUNT) {
+			ins->opcode = H_INVALID;
+			return;
+		}
+		op = ext;
+		ins->handler = H_ARGN + (op - OP_ARGN);
+	}
+	ins->opcode = op;
+
+	// ARGN: the pointer flags of the opcode byte are the number of values - 1,
+	// followed by a byte with a pointer flag for each value and the values
+	if (op == OP_ARGN) {
+		ins->arg[0] = (ins->op >> 5) + 1;
+		ins->arg[1] = vm->mem[pc++];
+		ins->addr = pc;
+		ins->next = pc + ins->arg[0];
+		if (!verify(vm, ins)) ins->handler = H_UNVERIFIED;
 		return;
 	}
 
-	u8 arg1Ptr = opByte & 0b10000000;
-	u8 arg2Ptr = opByte & 0b01000000;
-	u8 arg3Ptr = opByte & 0b00100000;
+	int flag = 0;
+	int argn = 0;
+
+	for (const char *f = opformats[op]; *f; f++) {
+		if (*f == 'a') {
+			if (ins->op & (0b10000000 >> flag++)) {
+				ins->addr = vm->mem[pc++];
+			} else {
+				ins->addr = vm->mem[pc] << 8 | vm->mem[(u16) (pc + 1)];
+				pc += 2;
+			}
+		} else {
+			flag++;
+			ins->arg[argn++] = vm->mem[pc++];
+		}
+	}
+
+	ins->next = pc;
+	if (!verify(vm, ins)) ins->handler = H_UNVERIFIED;
+}
 
-	vm->reg.rand = GetRandomValue(0, 0xFF);
+// Get the superinstruction that starts with the instruction at addr, if any.
+// Both instructions have passed verify(), so the superinstructions don't check
+// register numbers either. An H_IDLE jump isn't fused, it needs its handler.
+static u16 fuse(VM *vm, u16 addr) {
+	const Insn *a = &vm->code[addr];
+	const Insn *b = &vm->code[a->next];
+
+	if (a->handler == H_UNVERIFIED || b->handler == H_UNVERIFIED) return a->handler;
+	if (b->handler == H_IDLE) return a->handler;
+
+	switch (a->opcode) {
+		case OP_ADD:
+			if (
+				b->opcode == OP_ADD && !(a->op & 0b00100000) &&
+				(b->op & 0b01000000) && b->arg[1] == 63 && !(b->op & 0b00100000)
+			) return H_ADD16;
+			if (
+				b->opcode == OP_LTJ && !(a->op & 0b00100000) && !(b->op & 0b00100000)
+			) return H_ADDLTJ;
+			break;
 
-	char debugLine[128] = {0};
-	sprintf(debugLine, "0x%.4X  ", startPC);
-	strcat(debugLine, opnames[op]);
+		case OP_ARGN:
+			if (b->opcode == OP_SYS) return H_ARGSYS;
+			break;
+	}
+	return a->handler;
+}
+
+// Longest loop findIdle() looks at, in instructions
+#define IDLE_MAXLEN 16
+
+// Is the instruction at addr the jump back to the start of an idle loop: a
+// loop that doesn't store, call or use syscalls, and doesn't read a register
+// before writing it in the same iteration if the loop writes it. Every
+// iteration of such a loop does exactly the same thing, so once a whole
+// iteration from the start has taken the jump back, the loop can only end when
+// the input registers change at the end of the frame. The loop is the straight line from the jump target to the
+// jump, other jumps in it can only leave the loop.
+static bool findIdle(const VM *vm, u16 addr) {
+	const Insn *end = &vm->code[addr];
+	u8 addrFlag;
+
+	switch (end->opcode) {
+		case OP_JMP: addrFlag = 0b10000000; break;
+		case OP_CJ: addrFlag = 0b01000000; break;
+		case OP_EQJ: case OP_LTJ: case OP_GTJ: addrFlag = 0b00100000; break;
+		default: return false;
+	}
+	if ((end->op & addrFlag) || end->addr > addr) return false;
+
+	uint64_t written = 0;  // registers written so far in the iteration
+	uint64_t carried = 0;  // registers read before being written in it
+	u16 pc = end->addr;
+
+	for (int n = 0; n < IDLE_MAXLEN; n++) {
+		const Insn *ins = &vm->code[pc];
+		if (ins->handler == H_UNVERIFIED) return false;
+
+		int dest = -1;
+		uint64_t reads = 0;
+		uint64_t writes = 0;
+
+		switch (ins->opcode) {
+			case OP_NOP:
+				break;
+
+			case OP_SET: case OP_LD: case OP_LDX:
+				dest = 0;
+				break;
+
+			case OP_ADD: case OP_SUB: case OP_MUL:
+			case OP_SHL: case OP_SHR: case OP_ROL: case OP_ROR:
+				writes |= 1ull << 63;  // resH
+				// fall through
+			case OP_DIV: case OP_MOD: case OP_AND: case OP_OR: case OP_XOR:
+			case OP_EQ: case OP_LT: case OP_GT:
+				dest = 2;
+				break;
+
+			case OP_JMP: case OP_CJ: case OP_EQJ: case OP_LTJ: case OP_GTJ:
+				if (pc == addr) break;
+
+				// Jumps inside the loop could skip writes, only leaving it is
+				// allowed
+				if (ins->opcode == OP_JMP) return false;
+				if (ins->op & (ins->opcode == OP_CJ ? 0b01000000 : 0b00100000)) return false;
+				if (ins->addr >= end->addr && ins->addr <= addr) return false;
+				break;
+
+			default:
+				return false;
+		}
+
+		int flag = 0;
+		int argn = 0;
+
+		for (const char *f = opformats[ins->opcode]; *f; f++) {
+			bool ptr = ins->op & (0b10000000 >> flag++);
+
+			if (*f == 'a') {
+				if (ptr) reads |= 3ull << ins->addr;
+				continue;
+			}
+
+			u8 arg = ins->arg[argn];
+			if (argn++ == dest) {
+				// The destination is only known at runtime
+				if (ptr) return false;
+				writes |= 1ull << arg;
+			}
+			else if (ptr || *f == 'c' || *f == 'o') {
+				if (ptr && *f == 'c') return false;
+				reads |= 1ull << arg;
+				if (ptr && *f == 'o') writes |= 1ull << arg;
+			}
+		}
+
+		// Reading the rand register changes it
+		if (reads & 1ull << 62) return false;
+
+		carried |= reads & ~written;
+		written |= writes;
+
+		if (pc == addr) return !(carried & written);
+		pc = ins->next;
+		if (pc > addr) return false;
+	}
+	return false;
+}
+
+// How many times the instruction reads the rand register (%62) through
+// register numbers known when decoding. *dynamic is set if it also reads a
+// register whose number is only known at runtime, which can be %62 too. Used
+// by the JIT and gxrecomp, which only translate the reads when their order
+// doesn't matter.
+int vmRandReads(const VM *vm, const Insn *ins, bool *dynamic) {
+	int reads = 0;
+	int flag = 0;
+	int argn = 0;
+	*dynamic = false;
+
+	if (ins->opcode >= OP_COUNT) return 0;
+
+	if (ins->opcode == OP_ARGN) {
+		for (int i = 0; i < ins->arg[0]; i++) {
+			if ((ins->arg[1] & (0b10000000 >> i)) && vm->mem[ins->addr + i] == 62) reads++;
+		}
+		return reads;
+	}
+
+	for (const char *f = opformats[ins->opcode]; *f; f++) {
+		bool ptr = ins->op & (0b10000000 >> flag++);
+
+		if (*f == 'a') {
+			if (ptr && (ins->addr == 61 || ins->addr == 62)) reads++;
+			continue;
+		}
+
+		u8 arg = ins->arg[argn++];
+		if ((ptr || *f == 'c' || *f == 'o') && arg == 62) reads++;
+		if (ptr && *f == 'c') *dynamic = true;
+	}
+
+	// ST reads the register it stores
+	if (ins->opcode == OP_ST || ins->opcode == OP_STX) {
+		if (ins->op & 0b10000000) *dynamic = true;
+		else if (ins->arg[0] == 62) reads++;
+	}
+	return reads;
+}
+
+// Decode the whole ROM into the instruction cache. This needs to be called
+// again if the ROM is modified, for example by a debugger.
+void vmDecode(VM *vm) {
+	for (int i = 0; i < 0x8000; i++) decode(vm, i);
+	for (int i = 0x8000; i < CODE_SIZE; i++) vm->code[i] = (Insn) {.opcode = H_BADPC, .handler = H_BADPC};
+	for (int i = 0; i < 0x8000; i++) {
+		if (findIdle(vm, i)) vm->code[i].handler = H_IDLE;
+	}
+	for (int i = 0; i < 0x8000; i++) vm->code[i].handler = fuse(vm, i);
+
+	jitFlush(vm);
+}
+
+// Save SRAM using the host's storage callback.
+void vmSave(VM *vm) {
+	if (vm->host.saveSram) vm->host.saveSram(vm->host.user, vm->sram);
+}
+
+void vmDestroy(VM *vm) {
+	vmTraceClose(vm);
+	jitDestroy(vm);
+	free(vm);
+}
+
+// Stop the program and report an error to the host.
+void vmError(VM *vm, const char *fmt, ...) {
+	char buf[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	vm->state = ST_IDLE;
+	vm->needDraw = true;
+	if (vm->host.error) vm->host.error(vm->host.user, buf);
+}
+
+// _____________________________________________________________________________
+//
+//  Tracing
+// _____________________________________________________________________________
+//
+// Start writing a trace of every executed instruction to a file. The records
+// can be turned back into text with gxtrace.
+bool vmTraceOpen(VM *vm, const char *fileName) {
+	vmTraceClose(vm);
+
+	vm->traceBuf = malloc(TRACE_BUFLEN*sizeof(TraceRecord));
+	if (vm->traceBuf == NULL) return false;
+
+	vm->traceFile = fopen(fileName, "wb");
+	if (vm->traceFile == NULL) {
+		free(vm->traceBuf);
+		vm->traceBuf = NULL;
+		return false;
+	}
+
+	fwrite(TRACE_MAGIC, 1, 4, vm->traceFile);
+	vm->traceLen = 0;
+	return true;
+}
+
+static void traceFlush(VM *vm) {
+	fwrite(vm->traceBuf, sizeof(TraceRecord), vm->traceLen, vm->traceFile);
+	vm->traceLen = 0;
+}
+
+void vmTraceClose(VM *vm) {
+	if (vm->traceFile == NULL) return;
+
+	traceFlush(vm);
+	fclose(vm->traceFile);
+	free(vm->traceBuf);
+	vm->traceFile = NULL;
+	vm->traceBuf = NULL;
+}
+
+static void traceWrite(VM *vm, const TraceRecord *rec) {
+	vm->traceBuf[vm->traceLen++] = *rec;
+	if (vm->traceLen == TRACE_BUFLEN) traceFlush(vm);
+}
+
+// _____________________________________________________________________________
+//
+//  Execution
+// _____________________________________________________________________________
+//
+// Call a function: push vm->pc as the return address, swap the argument
+// registers with the ones given by ARG and clear the locals. The 8 registers
+// are moved as one 8-byte word each.
+void vmCall(VM *vm, u16 addr) {
+	Frame *f = &vm->frames[vm->sp++];
+	u8 temp[8];
+
+	memcpy(temp, vm->reg.args, 8);
+	memcpy(vm->reg.args, f->args, 8);
+	memcpy(f->args, temp, 8);
+	memcpy(f->local, vm->reg.local, 8);
+	memset(vm->reg.local, 0, 8);
+
+	f->ret = vm->pc;
+	vm->pc = addr;
+	vm->argsp = 0;
+}
+
+// Return from a function, restoring the caller's arguments and locals.
+void vmReturn(VM *vm) {
+	const Frame *f = &vm->frames[--vm->sp];
+
+	vm->pc = f->ret;
+	memcpy(vm->reg.args, f->args, 8);
+	memcpy(vm->reg.local, f->local, 8);
+}
+
+// Call a leaf function, which doesn't use the locals or call other functions:
+// like vmCall(), but the caller's locals are left in place.
+void vmCallFast(VM *vm, u16 addr) {
+	Frame *f = &vm->frames[vm->sp++];
+	u8 temp[8];
+
+	memcpy(temp, vm->reg.args, 8);
+	memcpy(vm->reg.args, f->args, 8);
+	memcpy(f->args, temp, 8);
+
+	f->ret = vm->pc;
+	vm->pc = addr;
+	vm->argsp = 0;
+}
+
+// Return from a function called with vmCallFast().
+void vmReturnFast(VM *vm) {
+	const Frame *f = &vm->frames[--vm->sp];
+
+	vm->pc = f->ret;
+	memcpy(vm->reg.args, f->args, 8);
+}
+
+// SYS_MATH, 16-bit arithmetic in one syscall instead of a chain of 8-bit
+// instructions through resH. See MathOp for the arguments.
+static bool sysMath(VM *vm, const u8 *args) {
+	// Registers in each of the operands, 0 if it's not a register
+	static const u8 sizes[MATH_COUNT][3] = {
+		[MATH_ADD] = {2, 2, 2}, [MATH_SUB] = {2, 2, 2}, [MATH_CMP] = {2, 2, 0},
+		[MATH_MUL] = {2, 2, 4}, [MATH_DIV] = {2, 0, 2}, [MATH_BCD] = {2, 5, 0}
+	};
+
+	u8 op = args[0];
+	if (op >= MATH_COUNT) {
+		vmError(vm, "Invalid math operation %d", op);
+		return false;
+	}
+
+	for (int i = 0; i < 3; i++) {
+		if (sizes[op][i] && args[i + 1] > 64 - sizes[op][i]) {
+			vmError(vm, "Invalid register access (%%%d) in math operation %d", args[i + 1], op);
+			return false;
+		}
+	}
+
+	u16 a = vmReadReg(vm, args[1]) << 8 | vmReadReg(vm, args[1] + 1);
+	u16 b = (sizes[op][1] == 2) ? (vmReadReg(vm, args[2]) << 8 | vmReadReg(vm, args[2] + 1)) : args[2];
+	u8 *r = vm->reg.data;
+	u8 dest = args[3];
+	uint32_t result;
 
 	switch (op) {
+		case MATH_ADD: case MATH_SUB:
+			result = (op == MATH_ADD) ? (uint32_t) a + b : (uint32_t) a - b;
+			r[dest] = result >> 8;
+			r[dest + 1] = result;
+			vm->reg.resH = result >> 16;
+			break;
+
+		case MATH_CMP:
+			vm->reg.rVal = (a == b) ? 0 : (a > b) ? 1 : 0xFF;
+			break;
+
+		case MATH_MUL:
+			result = (uint32_t) a*b;
+			for (int i = 0; i < 4; i++) r[dest + i] = result >> (24 - i*8);
+			break;
+
+		case MATH_DIV:
+			if (!b) {
+				vmError(vm, "Division by zero in math operation %d", op);
+				return false;
+			}
+			r[dest] = (a/b) >> 8;
+			r[dest + 1] = a/b;
+			vm->reg.rVal = a%b;
+			break;
+
+		case MATH_BCD: {
+			int digits = 1;
+			dest = args[2];
+
+			for (int i = 4; i >= 0; i--) {
+				u8 digit = a % 10;
+				a /= 10;
+				r[dest + i] = digit;
+				if (digit) digits = 5 - i;
+			}
+			vm->reg.rVal = digits;
+			break;
+		}
+	}
+	return true;
+}
+
+// Check a block of memory for the block memory syscalls: every address must be
+// readable by LD, or writable by ST if write is set.
+static bool checkBlock(VM *vm, const char *name, u16 addr, u16 len, bool write) {
+	if (addr + len > 0x10000) {
+		vmError(vm, "Memory block (0x%.4X, length %d) past 0xFFFF in %s", addr, len, name);
+		return false;
+	}
+	if (!len) return true;
+
+	if (write && addr < 0xE000) {
+		vmError(vm, "Invalid memory write (0x%.4X) in %s", addr, name);
+		return false;
+	}
+	if (!write && addr < 0xE000 && addr + len > 0x8000) {
+		vmError(vm, "Invalid memory read (0x%.4X) in %s", addr > 0x8000 ? addr : 0x8000, name);
+		return false;
+	}
+	return true;
+}
+
+// Give the visible part of the tilemap to the host, if it hasn't been drawn in
+// this frame yet. Done before anything else is drawn.
+static void drawMap(VM *vm) {
+	if (vm->map.drawn) return;
+	vm->map.drawn = true;
+	if (!vm->map.width || !vm->map.height || !vm->host.map) return;
+
+	int width = vm->map.width, height = vm->map.height;
+	int scrollX = vm->map.scrollX % (width*8);
+	int scrollY = vm->map.scrollY % (height*8);
+
+	MapView view;
+	view.fineX = scrollX % 8;
+	view.fineY = scrollY % 8;
+
+	for (int row = 0; row < MAP_ROWS; row++) {
+		const u8 *tiles = &vm->mem[vm->map.addr + ((scrollY/8 + row) % height)*width];
+		int col = 0;
+		for (int x = scrollX/8; col < MAP_COLS; x = 0) {
+			while (x < width && col < MAP_COLS) view.tiles[row][col++] = tiles[x++];
+		}
+	}
+
+	vm->host.map(vm->host.user, &view);
+}
+
+// Give the shown entries of the sprite table to the host, last entry first.
+static void drawSprites(VM *vm) {
+	if (!vm->host.sprites) return;
+
+	Sprite sprites[MAX_SPRITES];
+	int count = 0;
+
+	for (int i = vm->sprites.count - 1; i >= 0; i--) {
+		const u8 *entry = &vm->mem[vm->sprites.addr + i*4];
+		if (!(entry[3] & SPR_SHOW)) continue;
+
+		sprites[count++] = (Sprite) {
+			entry[0] > 248 ? entry[0] - 256 : entry[0],
+			entry[1] > 248 ? entry[1] - 256 : entry[1],
+			entry[2], entry[3]
+		};
+	}
+
+	if (count) vm->host.sprites(vm->host.user, sprites, count);
+}
+
+// Finish the frame, so the host shows it, and update the input registers. Done
+// by SYS_END and taken H_IDLE jumps.
+static void endFrame(VM *vm) {
+	drawMap(vm);
+	drawSprites(vm);
+	vm->map.drawn = false;
+	vm->needDraw = true;
+	vm->frame++;
+
+	VMInput input = {0};
+	if (vm->host.input) vm->host.input(vm->host.user, &input);
+	vm->reg.mouseX = input.mouseX;
+	vm->reg.mouseY = input.mouseY;
+
+	// Buttons count how many frames they have been held down
+	#define HELD(reg, down) \
+		if (down) { \
+			if (reg < 255) reg++; \
+		} else { \
+			reg = 0; \
+		}
+
+	HELD(vm->reg.mouseL, input.mouseL);
+	HELD(vm->reg.mouseR, input.mouseR);
+	HELD(vm->reg.up, input.up);
+	HELD(vm->reg.down, input.down);
+	HELD(vm->reg.left, input.left);
+	HELD(vm->reg.right, input.right);
+	HELD(vm->reg.act[0], input.act[0]);
+	HELD(vm->reg.act[1], input.act[1]);
+	HELD(vm->reg.act[2], input.act[2]);
+	#undef HELD
+}
+
+// Run a system call, the arguments are taken from the argument stack. Returns
+// false if the call caused an error. Shared by step() and the frame loops.
+bool vmSyscall(VM *vm, u8 call) {
+	if (call >= SYS_COUNT) {
+		vmError(vm, "Invalid system call 0x%.2X", call);
+		return false;
+	}
+
+	u8 args[8];
+	memcpy(args, vm->frames[vm->sp].args, 8);
+	memset(vm->frames[vm->sp].args, 0, 8);
+	vm->argsp = 0;
+
+	switch (call) {
+		case SYS_DRAW:
+			drawMap(vm);
+			if (vm->host.draw) vm->host.draw(
+				vm->host.user, args[0], args[1], args[2], args[3], args[4], args[5]
+			);
+			break;
+
+		case SYS_END:
+			endFrame(vm);
+			break;
+
+		case SYS_SOUND:
+			if (args[0] > 3) {
+				vmError(vm, "Invalid sound type %d", args[0]);
+				return false;
+			}
+			if (vm->host.sound) vm->host.sound(
+				vm->host.user, args[0], args[1], args[2], args[3]
+			);
+			break;
+
+		case SYS_MATH:
+			return sysMath(vm, args);
+
+		case SYS_MEMCPY: {
+			u16 dest = args[0] << 8 | args[1];
+			u16 src = args[2] << 8 | args[3];
+			u16 len = args[4] << 8 | args[5];
+			if (!checkBlock(vm, "memcpy", dest, len, true)) return false;
+			if (!checkBlock(vm, "memcpy", src, len, false)) return false;
+
+			memmove(&vm->mem[dest], &vm->mem[src], len);
+			break;
+		}
+
+		case SYS_MEMSET: {
+			u16 dest = args[0] << 8 | args[1];
+			u16 len = args[3] << 8 | args[4];
+			if (!checkBlock(vm, "memset", dest, len, true)) return false;
+
+			memset(&vm->mem[dest], args[2], len);
+			break;
+		}
+
+		case SYS_MEMCMP: {
+			u16 a = args[0] << 8 | args[1];
+			u16 b = args[2] << 8 | args[3];
+			u16 len = args[4] << 8 | args[5];
+			if (!checkBlock(vm, "memcmp", a, len, false)) return false;
+			if (!checkBlock(vm, "memcmp", b, len, false)) return false;
+
+			int result = memcmp(&vm->mem[a], &vm->mem[b], len);
+			vm->reg.rVal = (result > 0) ? 1 : (result < 0) ? 0xFF : 0;
+			break;
+		}
+
+		case SYS_KEEP:
+			if (args[0] > 1) {
+				vmError(vm, "Invalid keep screen value %d", args[0]);
+				return false;
+			}
+			vm->keepScreen = args[0];
+			break;
+
+		case SYS_CLEAR:
+			drawMap(vm);
+			if (vm->host.clear) vm->host.clear(
+				vm->host.user, vm->reg.clearX, vm->reg.clearY, args[2], args[3], args[0], args[1]
+			);
+			break;
+
+		case SYS_MAP: {
+			u16 addr = args[0] << 8 | args[1];
+			if (!checkBlock(vm, "map", addr, args[2]*args[3], false)) return false;
+
+			vm->map.addr = addr;
+			vm->map.width = args[2];
+			vm->map.height = args[3];
+			vm->map.scrollX = args[4] << 8 | args[5];
+			vm->map.scrollY = args[6] << 8 | args[7];
+			break;
+		}
+
+		case SYS_SPRITES: {
+			u16 addr = args[0] << 8 | args[1];
+			if (args[2] > MAX_SPRITES) {
+				vmError(vm, "Too many sprites (%d > %d)", args[2], MAX_SPRITES);
+				return false;
+			}
+			if (!checkBlock(vm, "sprites", addr, args[2]*4, false)) return false;
+
+			vm->sprites.addr = addr;
+			vm->sprites.count = args[2];
+			break;
+		}
+	}
+
+	return true;
+}
+
+// Execute one instruction. If rec is not NULL, the instruction is also
+// recorded into it. Returns false if the instruction caused an error.
+// This is always inlined into step(), so the untraced version has no tracing
+// code in it at all.
+static inline __attribute__((always_inline)) bool execute(VM *vm, TraceRecord *rec) {
+	u16 startPC = vm->pc;
+
+	if (startPC > 0x7FFF || vm->code[startPC].opcode == H_BADPC) {
+		vmError(vm, "Attempted to execute code at 0x%.4X", startPC);
+		return false;
+	}
+
+	const Insn *ins = &vm->code[startPC];
+
+	if (ins->opcode == H_INVALID) {
+		vmError(vm, "Invalid opcode at 0x%.4X: %d", startPC, ins->op & 0b00011111);
+		return false;
+	}
+
+	vm->pc = ins->next;
+
+	u8 arg1Ptr = ins->op & 0b10000000;
+	u8 arg2Ptr = ins->op & 0b01000000;
+	u8 arg3Ptr = ins->op & 0b00100000;
+
+	int argn = 0;
+	if (rec) {
+		rec->frame = vm->frame;
+		rec->pc = startPC;
+		rec->op = ins->op;
+		rec->opcode = ins->opcode;
+	}
+
+	switch (ins->opcode) {
 		#define CHECKREG(r) \
 			if (r > 63) { \
-				err("Invalid register access (%%%d) at 0x%.4X", r, startPC); \
-				return; \
+				vmError(vm, "Invalid register access (%%%d) at 0x%.4X", r, startPC); \
+				return false; \
 			}
 
 		#define DEREFPTR(cond, var) \
+			if (rec) rec->arg[argn] = var; \
 			if (cond) { \
 				CHECKREG(var); \
-				strcat(debugLine, TextFormat("[%.2X]->%.2X ", var, vm->reg.data[var])); \
-				var = vm->reg.data[var]; \
-			} else { \
-				strcat(debugLine, TextFormat("%.2X ", var)); \
-			}
+				var = vmReadReg(vm, var); \
+			} \
+			if (rec) rec->res[argn++] = var;
 
 		#define CONSUMEADDR(cond, var) \
 			if (cond) { \
-				u8 ptr = consume(); \
-				var = get16(reg.data, ptr); \
-				strcat(debugLine, TextFormat("[%.2X]->%.4X ", ptr, var)); \
+				CHECKREG(ins->addr + 1); \
+				var = vmReadReg(vm, ins->addr) << 8 | vmReadReg(vm, ins->addr + 1); \
+				if (rec) rec->addrArg = ins->addr; \
 			} else { \
-				var = consume16(); \
-				strcat(debugLine, TextFormat("%.4X ", var)); \
-			}
+				var = ins->addr; \
+			} \
+			if (rec) rec->addr = var;
 
 		case OP_NOP: break;
 
 		case OP_SET: {
-			u8 reg = consume();
+			u8 reg = ins->arg[0];
 			DEREFPTR(arg1Ptr, reg);
 
-			u8 val = consume();
+			u8 val = ins->arg[1];
 			DEREFPTR(arg2Ptr, val);
 
 			CHECKREG(reg);
@@ -103,15 +885,15 @@ void step(VM *vm) {
 		}
 
 		case OP_LD: {
-			u8 reg = consume();
+			u8 reg = ins->arg[0];
 			DEREFPTR(arg1Ptr, reg);
 
 			u16 addr;
 			CONSUMEADDR(arg2Ptr, addr);
 
 			if (addr > 0x7FFF && addr < 0xE000) {
-				err("Invalid memory read (0x%.4X) at 0x%.4X", addr, startPC);
-				return;
+				vmError(vm, "Invalid memory read (0x%.4X) at 0x%.4X", addr, startPC);
+				return false;
 			}
 
 			CHECKREG(reg);
@@ -120,31 +902,31 @@ void step(VM *vm) {
 		}
 
 		case OP_ST: {
-			u8 reg = consume();
+			u8 reg = ins->arg[0];
 			DEREFPTR(arg1Ptr, reg);
 
 			u16 addr;
 			CONSUMEADDR(arg2Ptr, addr);
 
 			if (addr < 0xE000) {
-				err("Invalid memory write (0x%.4X) at 0x%.4X", addr, startPC);
-				return;
+				vmError(vm, "Invalid memory write (0x%.4X) at 0x%.4X", addr, startPC);
+				return false;
 			}
 
 			CHECKREG(reg);
-			vm->mem[addr] = vm->reg.data[reg];
+			vm->mem[addr] = vmReadReg(vm, reg);
 			break;
 		}
 
 		#define BINOP16(op, sign) \
 			case OP_ ## op: { \
-				u8 first = consume(); \
+				u8 first = ins->arg[0]; \
 				DEREFPTR(arg1Ptr, first); \
 				\
-				u8 second = consume(); \
+				u8 second = ins->arg[1]; \
 				DEREFPTR(arg2Ptr, second); \
 				\
-				u8 dest = consume(); \
+				u8 dest = ins->arg[2]; \
 				DEREFPTR(arg3Ptr, dest); \
 				\
 				u16 result = first sign second; \
@@ -159,17 +941,17 @@ void step(VM *vm) {
 		BINOP16(MUL, *)
 
 		case OP_DIV: {
-			u8 first = consume();
+			u8 first = ins->arg[0];
 			DEREFPTR(arg1Ptr, first);
 		
-			u8 second = consume();
+			u8 second = ins->arg[1];
 			DEREFPTR(arg2Ptr, second);
 			if (!second) {
-				err("Division by zero at 0x%.4X", startPC);
-				return;
+				vmError(vm, "Division by zero at 0x%.4X", startPC);
+				return false;
 			}
 		
-			u8 dest = consume();
+			u8 dest = ins->arg[2];
 			DEREFPTR(arg3Ptr, dest);
 
 			CHECKREG(dest);
@@ -178,17 +960,17 @@ void step(VM *vm) {
 		}
 
 		case OP_MOD: {
-			u8 first = consume();
+			u8 first = ins->arg[0];
 			DEREFPTR(arg1Ptr, first);
 		
-			u8 second = consume();
+			u8 second = ins->arg[1];
 			DEREFPTR(arg2Ptr, second);
 			if (!second) {
-				err("Division by zero (mod) at 0x%.4X", startPC);
-				return;
+				vmError(vm, "Division by zero (mod) at 0x%.4X", startPC);
+				return false;
 			}
 		
-			u8 dest = consume();
+			u8 dest = ins->arg[2];
 			DEREFPTR(arg3Ptr, dest);
 
 			CHECKREG(dest);
@@ -198,13 +980,13 @@ void step(VM *vm) {
 
 		#define BINOP(op, sign) \
 			case OP_ ## op: { \
-				u8 first = consume(); \
+				u8 first = ins->arg[0]; \
 				DEREFPTR(arg1Ptr, first); \
 				\
-				u8 second = consume(); \
+				u8 second = ins->arg[1]; \
 				DEREFPTR(arg2Ptr, second); \
 				\
-				u8 dest = consume(); \
+				u8 dest = ins->arg[2]; \
 				DEREFPTR(arg3Ptr, dest); \
 				\
 				CHECKREG(dest); \
@@ -221,10 +1003,10 @@ void step(VM *vm) {
 
 		#define BINOPJ(op, sign) \
 			case OP_ ## op: { \
-				u8 first = consume(); \
+				u8 first = ins->arg[0]; \
 				DEREFPTR(arg1Ptr, first); \
 				\
-				u8 second = consume(); \
+				u8 second = ins->arg[1]; \
 				DEREFPTR(arg2Ptr, second); \
 				\
 				u8 cond = first sign second; \
@@ -242,10 +1024,10 @@ void step(VM *vm) {
 
 		#define BINOPCALL(op, sign) \
 			case OP_ ## op: { \
-				u8 first = consume(); \
+				u8 first = ins->arg[0]; \
 				DEREFPTR(arg1Ptr, first); \
 				\
-				u8 second = consume(); \
+				u8 second = ins->arg[1]; \
 				DEREFPTR(arg2Ptr, second); \
 				\
 				u8 cond = first sign second; \
@@ -253,7 +1035,7 @@ void step(VM *vm) {
 				u16 addr; \
 				CONSUMEADDR(arg3Ptr, addr); \
 				\
-				if (cond) call(vm, addr); \
+				if (cond) vmCall(vm, addr); \
 				break; \
 			}
 
@@ -262,15 +1044,15 @@ void step(VM *vm) {
 		BINOPCALL(GTC, >)
 
 		case OP_ARG: {
-			u8 val = consume();
+			u8 val = ins->arg[0];
 			DEREFPTR(arg1Ptr, val);
 			
 			if (vm->argsp > 7) {
-				err("Argument overflow at 0x%.4X", startPC);
-				return;
+				vmError(vm, "Argument overflow at 0x%.4X", startPC);
+				return false;
 			}
 
-			vm->argStack[vm->sp][vm->argsp++] = val;
+			vm->frames[vm->sp].args[vm->argsp++] = val;
 			break;
 		}
 
@@ -279,11 +1061,11 @@ void step(VM *vm) {
 			break;
 
 		case OP_CJ: {
-			u8 condReg = consume();
-			strcat(debugLine, TextFormat("[%.2X]->", condReg));
+			u8 condReg = ins->arg[0];
+			if (rec) rec->arg[argn++] = condReg;
 
 			CHECKREG(condReg);
-			u8 cond = vm->reg.data[condReg];
+			u8 cond = vmReadReg(vm, condReg);
 			DEREFPTR(arg1Ptr, cond);
 
 			u16 addr;
@@ -297,166 +1079,179 @@ void step(VM *vm) {
 			u16 addr;
 			CONSUMEADDR(arg1Ptr, addr);
 			
-			call(vm, addr);
+			vmCall(vm, addr);
 			break;
 		}
 
 		case OP_CC: {
-			u8 condReg = consume();
-			strcat(debugLine, TextFormat("[%.2X]->", condReg));
+			u8 condReg = ins->arg[0];
+			if (rec) rec->arg[argn++] = condReg;
 
 			CHECKREG(condReg);
-			u8 cond = vm->reg.data[condReg];
+			u8 cond = vmReadReg(vm, condReg);
 			DEREFPTR(arg1Ptr, cond);
 
 			u16 addr;
 			CONSUMEADDR(arg2Ptr, addr);
 			
-			if (cond) call(vm, addr);
+			if (cond) vmCall(vm, addr);
 			break;
 		}
 
 		case OP_RET:
-			vm->pc = vm->callStack[--vm->sp];
-
-			for (int i = 0; i < 8; i++) {
-				vm->reg.args[i] = vm->argStack[vm->sp][i];
-				vm->reg.local[i] = vm->localStack[vm->sp][i];
-			}
+			vmReturn(vm);
 			break;
 
 		case OP_RETV: {
-			u8 val = consume();
+			u8 val = ins->arg[0];
 			DEREFPTR(arg1Ptr, val);
 			vm->reg.rVal = val;
-
-			vm->pc = vm->callStack[--vm->sp];
-
-			for (int i = 0; i < 8; i++) {
-				vm->reg.args[i] = vm->argStack[vm->sp][i];
-				vm->reg.local[i] = vm->localStack[vm->sp][i];
-			}
+			vmReturn(vm);
 			break;
 		}
 
 		case OP_SYS: {
-			u8 call = consume();
+			u8 call = ins->arg[0];
 			DEREFPTR(arg1Ptr, call);
 
-			if (call >= SYS_COUNT) {
-				err("Invalid system call 0x%.2X", call);
-				return;
-			}
-			strcat(debugLine, sysnames[call]);
+			if (!vmSyscall(vm, call)) return false;
+			break;
+		}
 
-			u8 args[8];
-			for (int i = 0; i < 8; i++) {
-				args[i] = vm->argStack[vm->sp][i];
-				vm->argStack[vm->sp][i] = 0;
-			}
-			vm->argsp = 0;
-
-			switch (call) {
-				case SYS_DRAW:
-					DrawTextureRec(
-						vm->tileset,
-						(Rectangle){args[0], args[1], args[2], args[3]},
-						(Vector2){args[4], args[5]}, WHITE
-					);
-					break;
-
-				case SYS_END:
-					vm->needDraw = true;
-					vm->reg.mouseX = GetMouseX() / vm->scale;
-					vm->reg.mouseY = GetMouseY() / vm->scale;
-
-					if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
-						if (vm->reg.mouseL < 255) vm->reg.mouseL++; 
-					} else {
-						vm->reg.mouseL = 0;
-					}
-
-					if (IsMouseButtonDown(MOUSE_BUTTON_RIGHT)) {
-						if (vm->reg.mouseR < 255) vm->reg.mouseR++;
-					} else {
-						vm->reg.mouseR = 0;
-					}
-
-					if (IsKeyDown(KEY_UP) || IsKeyDown(KEY_W)) {
-						if (vm->reg.up < 255) vm->reg.up++;
-					} else {
-						vm->reg.up = 0;
-					}
-
-					if (IsKeyDown(KEY_DOWN) || IsKeyDown(KEY_S)) {
-						if (vm->reg.down < 255) vm->reg.down++;
-					} else {
-						vm->reg.down = 0;
-					}
-
-					if (IsKeyDown(KEY_LEFT) || IsKeyDown(KEY_A)) {
-						if (vm->reg.left < 255) vm->reg.left++;
-					} else {
-						vm->reg.left = 0;
-					}
-
-					if (IsKeyDown(KEY_RIGHT) || IsKeyDown(KEY_D)) {
-						if (vm->reg.right < 255) vm->reg.right++;
-					} else {
-						vm->reg.right = 0;
-					}
-
-					if (IsKeyDown(KEY_J)) {
-						if (vm->reg.act[0] < 255) vm->reg.act[0]++;
-					} else {
-						vm->reg.act[0] = 0;
-					}
-					
-					if (IsKeyDown(KEY_K)) {
-						if (vm->reg.act[1] < 255) vm->reg.act[1]++;
-					} else {
-						vm->reg.act[1] = 0;
-					}
-					
-					if (IsKeyDown(KEY_L)) {
-						if (vm->reg.act[2] < 255) vm->reg.act[2]++;
-					} else {
-						vm->reg.act[2] = 0;
-					}
-					break;
-
-				case SYS_SOUND: {
-					if (args[0] > 3) {
-						err("Invalid sound type %d", args[0]);
-						return;
-					}
-					UnloadSound(vm->curSound[args[0]]);
-
-					WaveParams params = {0};
-					ResetWaveParams(&params);
-
-					params.waveTypeValue = args[0];
-					params.startFrequencyValue = (float) args[1] / 255;
-					params.sustainTimeValue = (float) args[2] / 255;
-					params.decayTimeValue = (float) args[3] / 255;
-
-					Wave wave = GenerateWave(params);
-					vm->curSound[args[0]] = LoadSoundFromWave(wave);
-					PlaySound(vm->curSound[args[0]]);
-
-					UnloadWave(wave);
-					break;
+		case OP_CALLF: {
+			u16 addr;
+			CONSUMEADDR(arg1Ptr, addr);
+
+			vmCallFast(vm, addr);
+			break;
+		}
+
+		case OP_RETF:
+			vmReturnFast(vm);
+			break;
+
+		case OP_LDX: case OP_STX: {
+			u8 reg = ins->arg[0];
+			DEREFPTR(arg1Ptr, reg);
+
+			u16 addr;
+			CONSUMEADDR(arg2Ptr, addr);
+
+			u8 offReg = ins->arg[1];
+			u8 off = offReg;
+			DEREFPTR(true, off);
+			addr += off;
+
+			if (ins->opcode == OP_LDX) {
+				if (addr > 0x7FFF && addr < 0xE000) {
+					vmError(vm, "Invalid memory read (0x%.4X) at 0x%.4X", addr, startPC);
+					return false;
+				}
+
+				CHECKREG(reg);
+				vm->reg.data[reg] = vm->mem[addr];
+			} else {
+				if (addr < 0xE000) {
+					vmError(vm, "Invalid memory write (0x%.4X) at 0x%.4X", addr, startPC);
+					return false;
 				}
+
+				CHECKREG(reg);
+				vm->mem[addr] = vmReadReg(vm, reg);
+			}
+
+			if (arg3Ptr) vm->reg.data[offReg] = off + 1;
+			break;
+		}
+
+		case OP_SHL: case OP_SHR: case OP_ROL: case OP_ROR: {
+			u8 val = ins->arg[0];
+			DEREFPTR(arg1Ptr, val);
+
+			u8 amount = ins->arg[1];
+			DEREFPTR(arg2Ptr, amount);
+
+			u8 dest = ins->arg[2];
+			DEREFPTR(arg3Ptr, dest);
+
+			u16 result = vmShift(ins->opcode, val, amount);
+			CHECKREG(dest);
+			vm->reg.data[dest] = result & 0xFF;
+			vm->reg.resH = result >> 8;
+			break;
+		}
+
+		case OP_ARGN: {
+			int count = ins->arg[0];
+			if (rec) rec->addrArg = ins->arg[1];
+
+			if (vm->argsp > 8 - count) {
+				vmError(vm, "Argument overflow at 0x%.4X", startPC);
+				return false;
 			}
 
+			for (int i = 0; i < count; i++) {
+				u8 val = vm->mem[ins->addr + i];
+				DEREFPTR(ins->arg[1] & (0b10000000 >> i), val);
+				vm->frames[vm->sp].args[vm->argsp++] = val;
+			}
 			break;
 		}
 	}
 
-	TraceLog(LOG_DEBUG, debugLine);
+	return true;
+}
+
+// Execute one instruction like step(), without the idle check
+static bool stepOne(VM *vm) {
+	vm->insCount++;
+
+	if (vm->traceFile) {
+		TraceRecord rec = {0};
+		if (!execute(vm, &rec)) return false;
+		traceWrite(vm, &rec);
+		return true;
+	}
+	return execute(vm, NULL);
+}
 
-	if (vm->needDraw) {
-		TraceLog(LOG_DEBUG, "_________________________________________________________________________");
-		TraceLog(LOG_DEBUG, "");
+// If the instruction at pc was an H_IDLE jump and it was taken, run one
+// iteration of the loop from its start. If that gets back to the jump and
+// takes it again, the loop can't end before the frame does, see findIdle(),
+// so the frame is ended. The jump alone isn't enough: the loop may have been
+// entered in the middle, and the rest of that first iteration can still
+// leave it. Returns false if an instruction caused an error.
+static bool idleCheck(VM *vm, u16 pc) {
+	if (pc > 0x7FFF || vm->state != ST_RUNNING) return true;
+
+	const Insn *ins = &vm->code[pc];
+	if (ins->handler != H_IDLE || vm->pc != ins->addr) return true;
+
+	for (int n = 0; n < IDLE_MAXLEN; n++) {
+		u16 at = vm->pc;
+		if (!stepOne(vm)) return false;
+
+		// Left the loop, the engine continues from there
+		if (vm->pc < ins->addr || vm->pc > pc) return true;
+		if (at == pc) {
+			vm->idleFrames++;
+			endFrame(vm);
+			return true;
+		}
 	}
+	return true;
+}
+
+void step(VM *vm) {
+	u16 pc = vm->pc;
+	if (stepOne(vm)) idleCheck(vm, pc);
+}
+
+// Execute the instruction at vm->pc, returns false if it caused an error. Used
+// by the other engines for instructions they don't run themselves, including
+// H_IDLE jumps.
+bool vmExecute(VM *vm) {
+	u16 pc = vm->pc;
+	if (!stepOne(vm)) return false;
+	return idleCheck(vm, pc);
 }
\ No newline at end of file
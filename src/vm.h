@@ -1,8 +1,10 @@
 #ifndef VM_H
 #define VM_H
 
-#include "raylib.h"
+// The VM core doesn't depend on raylib, everything it needs from the outside
+// world (drawing, sound, input, save files) goes through the VMHost callbacks.
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -14,6 +16,22 @@
 #define SCREENW 192
 #define SCREENH 160
 
+// Tiles of the tilemap that can be seen at once, with fine scrolling a part of
+// one more row and column is visible
+#define MAP_COLS (SCREENW/8 + 1)
+#define MAP_ROWS (SCREENH/8 + 1)
+
+// Max entries in the sprite table
+#define MAX_SPRITES 64
+
+// Entries in VM.code: the ROM, and after it the furthest an instruction that
+// starts in it can reach. An ARGN at 0x7FFF with 8 values has its next
+// instruction at 0x800A.
+#define CODE_SIZE (0x8000 + 11)
+
+// Default VM.jitHot, set by vmCreate()
+#define JIT_HOT 32
+
 typedef enum Opcode {
 	OP_NOP, OP_SET, OP_LD, OP_ST,
 	OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,
@@ -22,15 +40,73 @@ typedef enum Opcode {
 	OP_EQJ, OP_LTJ, OP_GTJ,
 	OP_EQC, OP_LTC, OP_GTC,
 	OP_ARG, OP_JMP, OP_CJ, OP_CALL, OP_CC, OP_RET, OP_RETV,
-	OP_SYS,
+	OP_SYS, OP_CALLF, OP_RETF,
+
+	// Prefix of the extended opcodes below, the next byte is
+	// opcode - (OP_EXT + 1). The operands come after it.
+	OP_EXT,
+	OP_ARGN,  // arg with 1-8 values, see decode()
+	OP_LDX, OP_STX,
+	OP_SHL, OP_SHR, OP_ROL, OP_ROR,  // see vmShift()
 	OP_COUNT
 } Opcode;
 
 typedef enum Syscall {
-	SYS_DRAW, SYS_END, SYS_SOUND,
+	SYS_DRAW, SYS_END, SYS_SOUND, SYS_MATH,
+
+	// Block memory operations, the addresses and the length are 16-bit
+	// arguments (high byte first). Blocks follow the LD/ST rules for every
+	// address and can't go past 0xFFFF.
+	SYS_MEMCPY,  // dest src length, the blocks can overlap
+	SYS_MEMSET,  // dest value length
+	SYS_MEMCMP,  // a b length: rVal = 0 if equal, 1 if a > b, 0xFF if a < b
+
+	// Retained screen: after SYS_KEEP 1 the screen isn't cleared when a frame
+	// starts, so the program only has to draw what changed. SYS_CLEAR fills
+	// part of the screen with the clearX/clearY pixel.
+	SYS_KEEP,    // on (0 or 1)
+	SYS_CLEAR,   // x y w h
+
+	// Tilemap layer, see VM.map
+	SYS_MAP,     // addr width height scrollX scrollY, all 16-bit except the size
+
+	// Sprite table, see VM.sprites
+	SYS_SPRITES, // addr (16-bit) count
 	SYS_COUNT
 } Syscall;
 
+// Operations of SYS_MATH, given as its first argument. The other arguments are
+// register numbers, a 16-bit number is a register pair with the high byte first
+// (like addresses), longer results use more registers in the same order.
+typedef enum MathOp {
+	MATH_ADD,  // a b dest: dest = a + b, resH = carry (0 or 1)
+	MATH_SUB,  // a b dest: dest = a - b, resH = borrow (0 or 0xFF)
+	MATH_CMP,  // a b: rVal = 0 if a == b, 1 if a > b, 0xFF if a < b
+	MATH_MUL,  // a b dest: 32-bit dest (4 registers) = a*b
+	MATH_DIV,  // a val dest: dest = a/val, rVal = a%val, val is an 8-bit value
+	MATH_BCD,  // a dest: 5 registers of decimal digits, rVal = digits without
+	           // leading zeros (at least 1)
+	MATH_COUNT
+} MathOp;
+
+// How vmRunFrame() executes instructions
+typedef enum Engine {
+	ENGINE_AUTO,      // fastest available, ENGINE_NATIVE if vm->native is set
+	ENGINE_STEP,      // step() one instruction at a time, used for tracing
+	ENGINE_SWITCH,    // frame loop with switch dispatch
+	ENGINE_THREADED,  // frame loop with computed goto dispatch (GCC/Clang)
+	ENGINE_JIT,       // x86-64 JIT, falls back to ENGINE_THREADED elsewhere
+	ENGINE_NATIVE,    // vm->native, a ROM recompiled to C with gxrecomp
+	ENGINE_COUNT
+} Engine;
+
+// Why vmRunFrame() returned
+typedef enum RunResult {
+	RUN_END,     // the frame was finished with SYS_END
+	RUN_ERROR,   // an error stopped the program, or it wasn't running
+	RUN_BUDGET   // the instruction budget ran out, the frame isn't finished
+} RunResult;
+
 typedef enum State {
 	ST_IDLE,
 	ST_RUNNING,
@@ -62,6 +138,129 @@ typedef struct Registers {
 	};
 } Registers;
 
+// Input state, filled in by the host at the end of every frame. The VM turns
+// the button states into the "frames held" counters in the registers.
+typedef struct VMInput {
+	u8 mouseX;
+	u8 mouseY;
+	bool mouseL;
+	bool mouseR;
+	bool up;
+	bool down;
+	bool left;
+	bool right;
+	bool act[3];
+} VMInput;
+
+// The part of the tilemap that is on the screen, given to the map callback.
+// Tile numbers count 8 × 8 tiles in the tileset from left to right, 16 per
+// row. The tile in the top left corner is drawn at -fineX, -fineY.
+typedef struct MapView {
+	u8 fineX, fineY;
+	u8 tiles[MAP_ROWS][MAP_COLS];
+} MapView;
+
+// Flags of a sprite table entry
+typedef enum SpriteFlag {
+	SPR_FLIPX = 0x01,  // mirrored horizontally
+	SPR_FLIPY = 0x02,  // mirrored vertically
+	SPR_SHOW = 0x80    // drawn, entries without it are skipped
+} SpriteFlag;
+
+// A sprite to draw, given to the sprites callback. Entries in the sprite table
+// are x, y, tile, flags, the VM turns x and y above 248 into negative
+// positions so sprites can go partly off the left and top edges. The tile
+// number is the same as in MapView.
+typedef struct Sprite {
+	int16_t x, y;
+	u8 tile;
+	u8 flags;
+} Sprite;
+
+// Callbacks from the VM to the program hosting it. Any of them can be NULL,
+// for example a headless host can leave out draw, sound and input.
+typedef struct VMHost {
+	void *user;  // passed as the first argument to every callback
+
+	void (*draw)(void *user, u8 sx, u8 sy, u8 w, u8 h, u8 x, u8 y);
+	void (*clear)(void *user, u8 sx, u8 sy, u8 w, u8 h, u8 x, u8 y);  // fill with pixel sx, sy
+	void (*map)(void *user, const MapView *view);
+	void (*sprites)(void *user, const Sprite *sprites, int count);  // in drawing order
+	void (*sound)(void *user, u8 type, u8 freq, u8 sust, u8 decay);
+	void (*input)(void *user, VMInput *input);
+
+	// SRAM is loaded when a ROM is loaded and saved with vmSave()
+	void (*loadSram)(void *user, u8 *sram);
+	void (*saveSram)(void *user, const u8 *sram);
+
+	void (*error)(void *user, const char *msg);
+} VMHost;
+
+// One executed instruction in a trace file. Trace files start with TRACE_MAGIC
+// followed by the records in the host's byte order.
+typedef struct TraceRecord {
+	uint32_t frame;   // frame number, counted by SYS_END
+	u16 pc;           // address of the instruction
+	u16 addr;         // address operand, after dereferencing
+	u8 op;            // opcode byte, including the pointer flags
+	u8 opcode;        // Opcode, differs from the opcode byte for extended opcodes
+	u8 addrArg;       // register containing the address if it's a pointer, or
+	                  // the pointer flags of ARGN
+	u8 arg[8];        // 8-bit operands, before dereferencing
+	u8 res[8];        // 8-bit operands, after dereferencing
+} TraceRecord;
+
+// An instruction decoded from ROM. vmDecode() decodes the instruction at every
+// ROM address when a ROM is loaded, the ROM can't change while running (ST
+// only writes to RAM/SRAM), so instructions are executed from this cache.
+typedef struct Insn {
+	u16 handler;      // what the frame loops execute, the opcode byte or a Handler
+	u16 opcode;       // the instruction's Opcode, or H_BADPC/H_INVALID
+	u8 op;            // opcode byte, including the pointer flags
+	u8 arg[3];        // 8-bit operands in order, ARGN has the count and pointer flags
+	u16 addr;         // address operand, or register containing it if it's a pointer,
+	                  // ARGN has the address of its operands
+	u16 next;         // address of the next instruction
+} Insn;
+
+// Handlers for instructions that can't be executed, and superinstructions that
+// run a common sequence of instructions with one dispatch. The superinstruction
+// is only used when the sequence is entered from its first instruction. They
+// come after the 256 opcode bytes.
+typedef enum Handler {
+	H_BADPC = 0x100,     // outside of the code area
+	H_INVALID,           // invalid opcode
+	H_UNVERIFIED,        // operands that always cause an error, see verify()
+	H_IDLE,              // jump back to the start of an idle loop, see findIdle()
+	H_ARGN,              // extended opcodes, in the same order as in Opcode, don't
+	H_LDX,               // have a handler for each combination of flags
+	H_STX,
+	H_SHL, H_SHR, H_ROL, H_ROR,
+
+	H_ADD16,  // add [lo] x lo; add [hi] [resH] hi (16-bit add)
+	H_ADDLTJ, // add x y z; ltj ... (loop counter)
+	H_ARGSYS, // arg with several values followed by sys
+	H_COUNT
+} Handler;
+
+#define FUSE_FIRST H_ADD16
+#define FUSE_COUNT (H_COUNT - FUSE_FIRST)
+
+// One entry of the call stack. CALL swaps the argument registers with args and
+// saves the locals, RET copies both back. CALLF and RETF only use args and ret,
+// local is left as it was. The entry at the top of the stack
+// (vm->frames[vm->sp]) holds the arguments given with ARG for the next call.
+typedef struct Frame {
+	u8 args[8];
+	u8 local[8];
+	u16 ret;          // return address
+} Frame;
+
+#define TRACE_MAGIC "GXT\2"
+#define TRACE_BUFLEN 4096
+
+typedef struct Jit Jit;  // jit.c
+
 typedef struct VM {
 	Registers reg;
 
@@ -79,26 +278,156 @@ typedef struct VM {
 	u8 sp;
 	u8 argsp;
 
-	u16 callStack[256];
-	u8 argStack[256][8];
-	u8 localStack[256][8];
+	Frame frames[256];
 
-	State state;
+	// Decoded ROM, the extra entries after the end of ROM catch instructions
+	// that run past it
+	Insn code[CODE_SIZE];
 
+	State state;
 	bool needDraw;
-	int scale;
-	Texture tileset;
-	RenderTexture screen;
-	Sound curSound[4];
-
-	bool debug;
-	bool noSave;
-	char fileName[256];
+	bool keepScreen;  // set by SYS_KEEP, the host doesn't clear the screen when a frame starts
+	uint32_t frame;
+
+	// Tilemap set by SYS_MAP: width × height tile numbers at addr, one byte
+	// each, row by row. It's drawn once per frame before the first SYS_DRAW,
+	// SYS_CLEAR or SYS_END, so under everything the program draws, with the
+	// tile numbers and scroll position at that point. Scrolling wraps around
+	// the map. 0 width or height = no tilemap.
+	struct {
+		u16 addr;
+		u8 width, height;
+		u16 scrollX, scrollY;
+		bool drawn;  // drawn in this frame already
+	} map;
+
+	// Sprite table set by SYS_SPRITES: count 4-byte entries at addr, see
+	// Sprite. The shown entries are drawn over everything else when the frame
+	// ends, entry 0 on top.
+	struct {
+		u16 addr;
+		u8 count;
+	} sprites;
+
+	Engine engine;
+	uint32_t seed;      // seed for the rand register, used by vmLoad()
+	uint32_t rng;       // state of the rand register's generator, see vmRand()
+	uint64_t budget;    // max instructions per vmRunFrame() call, 0 = no limit
+	uint64_t insCount;  // instructions executed since loading
+
+	// Lag frames: vmRunFrame() calls in a row that ran out of budget without
+	// finishing the frame. After watchdog of them the program is stopped with
+	// an error, 0 = never.
+	uint32_t lagFrames;
+	uint32_t watchdog;
+
+	// Frames ended early by a taken H_IDLE jump since loading, the program
+	// was waiting for something that only changes between frames
+	uint32_t idleFrames;
+
+	// How many times the frame loops have run each superinstruction since
+	// loading
+	uint64_t fuseCount[FUSE_COUNT];
+	Jit *jit;
+
+	// ENGINE_JIT interprets a block the first jitHot times it's entered and
+	// only translates it after that, so code that rarely runs (setup, error
+	// paths) isn't worth translating. 0 = translate every block right away.
+	uint32_t jitHot;
+
+	// JIT statistics since loading: blocks translated, blocks that have been
+	// interpreted because they weren't hot yet, how many times they were
+	// entered and how many instructions they ran
+	uint32_t jitBlocks;
+	uint32_t jitColdBlocks;
+	uint64_t jitColdRuns;
+	uint64_t jitColdIns;
+
+	// Set by the host when the loaded ROM has been recompiled with gxrecomp,
+	// used by ENGINE_NATIVE
+	RunResult (*native)(struct VM *vm, uint64_t budget);
+
+	FILE *traceFile;
+	TraceRecord *traceBuf;
+	int traceLen;
+
+	VMHost host;
 } VM;
 
+extern const char *opnames[];
+extern const char *sysnames[];
+extern const char *opformats[];
+extern const char *fusenames[];
+
+VM *vmCreate(const VMHost *host);
+bool vmLoad(VM *vm, const u8 *file, unsigned int size);
+void vmDecode(VM *vm);
+RunResult vmRunFrame(VM *vm);
+void vmSave(VM *vm);
+void vmDestroy(VM *vm);
+void vmError(VM *vm, const char *fmt, ...);
+bool vmTraceOpen(VM *vm, const char *fileName);
+void vmTraceClose(VM *vm);
+
+bool vmSyscall(VM *vm, u8 call);
+void vmCall(VM *vm, u16 addr);
+void vmReturn(VM *vm);
+void vmCallFast(VM *vm, u16 addr);
+void vmReturnFast(VM *vm);
+RunResult vmInterpret(VM *vm, uint64_t budget);
 void step(VM *vm);
+bool vmExecute(VM *vm);
+int vmRandReads(const VM *vm, const Insn *ins, bool *dynamic);
+
+// jit.c, these do nothing when the JIT isn't supported
+RunResult runJit(VM *vm, uint64_t budget);
+void jitFlush(VM *vm);
+void jitDestroy(VM *vm);
 #define get16(memType, i) vm->memType[i] << 8 | vm->memType[i + 1]
-#define consume() vm->rom[vm->pc++]
-#define consume16() consume() << 8 | consume()
 
-#endif // vm.h
\ No newline at end of file
+// Get a new value for the rand register (%62). The register isn't updated on
+// every instruction, instead every read of it gets the next value of this
+// xorshift generator, so programs that don't use it don't pay for it.
+static inline u8 vmRand(VM *vm) {
+	uint32_t x = vm->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	vm->rng = x;
+	vm->reg.rand = x >> 24;
+	return vm->reg.rand;
+}
+
+// Read a register, see vmRand()
+static inline u8 vmReadReg(VM *vm, u16 reg) {
+	return reg == 62 ? vmRand(vm) : vm->reg.data[reg];
+}
+
+// Result of SHL, SHR, ROL or ROR, the value for the destination register in
+// the low byte and resH in the high byte. Shifts work on 16 bits like the other
+// arithmetic: SHL leaves the bits shifted out of the top in resH, SHR the bits
+// shifted out of the bottom, and shifting by 16 or more gives 0. Rotates turn
+// the 8-bit value by amount % 8 and set resH like the shift the same way.
+static inline u16 vmShift(u16 opcode, u8 val, u8 amount) {
+	unsigned n = amount > 16 ? 16 : amount;
+	u16 r;
+
+	switch (opcode) {
+		case OP_SHL:
+			return (u16) (val << n);
+
+		case OP_SHR:
+			r = (val << 8) >> n;
+			return (u16) (r << 8 | r >> 8);
+
+		case OP_ROL:
+			r = val << (amount & 7);
+			return (r & 0xFF00) | ((r | r >> 8) & 0xFF);
+
+		default:
+			r = (val << 8) >> (amount & 7);
+			return (u16) (r << 8 | ((r >> 8 | r) & 0xFF));
+	}
+}
+
+#endif // vm.h
@@ -0,0 +1,247 @@
+#include "vm.h"
+#include "render.h"
+#include <time.h>
+
+// Built with a ROM recompiled by gxrecomp: RECOMP=file.c ./build_tools.sh
+#ifdef RECOMP
+	#include "recomp.h"
+#endif
+
+// _____________________________________________________________________________
+//
+//  gxbench: run a ROM without a window and measure each VM engine's speed
+// _____________________________________________________________________________
+//
+const char *engineNames[] = {"auto", "step", "switch", "threaded", "jit", "native"};
+
+const char *saveName = NULL;
+bool failed = false;
+Render *render = NULL;
+
+void onError(void *user, const char *msg) {
+	(void) user;
+	fprintf(stderr, "error: %s\n", msg);
+	failed = true;
+}
+
+void onLoadSram(void *user, u8 *sram) {
+	(void) user;
+	if (!saveName) return;
+
+	FILE *file = fopen(saveName, "rb");
+	if (!file) {
+		fprintf(stderr, "error: failed to open %s\n", saveName);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!fread(sram, 1, 0x1000, file)) fprintf(stderr, "warning: %s is empty\n", saveName);
+	fclose(file);
+}
+
+void onDraw(void *user, u8 sx, u8 sy, u8 w, u8 h, u8 x, u8 y) {
+	(void) user;
+	renderDraw(render, sx, sy, w, h, x, y);
+}
+
+void onClear(void *user, u8 sx, u8 sy, u8 w, u8 h, u8 x, u8 y) {
+	(void) user;
+	renderFill(render, sx, sy, w, h, x, y);
+}
+
+void onMap(void *user, const MapView *view) {
+	(void) user;
+	renderMap(render, view);
+}
+
+void onSprites(void *user, const Sprite *sprites, int count) {
+	(void) user;
+	renderSprites(render, sprites, count);
+}
+
+// Give the software renderer a tileset of 8 × 8 squares in all 16 colors,
+// color 0 is transparent
+void loadTestTileset(void) {
+	static u8 rgba[TILESET_SIZE*TILESET_SIZE*4];
+
+	for (int y = 0; y < TILESET_SIZE; y++) {
+		for (int x = 0; x < TILESET_SIZE; x++) {
+			u8 color = (x/8 + y/8) % PALETTE_SIZE;
+			u8 *pixel = &rgba[(y*TILESET_SIZE + x)*4];
+			pixel[0] = color*16;
+			pixel[1] = 255 - color*16;
+			pixel[2] = color*4;
+			pixel[3] = color ? 255 : 0;
+		}
+	}
+	renderSetTileset(render, rgba, TILESET_SIZE, TILESET_SIZE);
+}
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Hash the registers and RAM, used to check that every engine got the same result
+uint64_t hashState(VM *vm) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < 64; i++) hash = (hash ^ vm->reg.data[i]) * 1099511628211ULL;
+	for (int i = 0xE000; i < 0x10000; i++) hash = (hash ^ vm->mem[i]) * 1099511628211ULL;
+	if (render) {
+		for (int i = 0; i < SCREENW*SCREENH; i++) hash = (hash ^ render->screen[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+void help(int exitcode) {
+	puts("gxbench: gxVM benchmark\n");
+	puts("Usage: gxbench [options] file");
+	puts("-h, --help         Show this message");
+	puts("-f, --frames N     Number of frames to run (default 600)");
+	puts("-s, --save file    Load SRAM from file");
+	puts("-S, --seed N       Seed for the rand register (default 1)");
+	puts("-e, --engine name  Only run one engine (step, switch, threaded, jit, native)");
+	puts("-d, --draw         Draw with the software renderer and a test tileset, the");
+	puts("                   screen is included in the state");
+	puts("-H, --hot N        Times the JIT interprets a block before translating it");
+	puts("-r, --report       Show how many times each superinstruction was run, how");
+	puts("                   many frames were ended early by idle loops and how much");
+	puts("                   code the JIT translated or left to the interpreter");
+	exit(exitcode);
+}
+
+int main(int argc, char **argv) {
+	char *fileName = NULL;
+	int frames = 600;
+	int onlyEngine = -1;
+	bool report = false;
+	uint32_t seed = 1;
+	uint32_t hot = JIT_HOT;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
+			help(0);
+		}
+		else if ((!strcmp(argv[i], "--frames") || !strcmp(argv[i], "-f")) && i + 1 < argc) {
+			frames = atoi(argv[++i]);
+		}
+		else if ((!strcmp(argv[i], "--save") || !strcmp(argv[i], "-s")) && i + 1 < argc) {
+			saveName = argv[++i];
+		}
+		else if ((!strcmp(argv[i], "--seed") || !strcmp(argv[i], "-S")) && i + 1 < argc) {
+			seed = strtoul(argv[++i], NULL, 0);
+		}
+		else if (!strcmp(argv[i], "--draw") || !strcmp(argv[i], "-d")) {
+			render = calloc(1, sizeof(Render));
+			if (!render) return EXIT_FAILURE;
+			loadTestTileset();
+		}
+		else if ((!strcmp(argv[i], "--hot") || !strcmp(argv[i], "-H")) && i + 1 < argc) {
+			hot = strtoul(argv[++i], NULL, 0);
+		}
+		else if (!strcmp(argv[i], "--report") || !strcmp(argv[i], "-r")) {
+			report = true;
+		}
+		else if ((!strcmp(argv[i], "--engine") || !strcmp(argv[i], "-e")) && i + 1 < argc) {
+			i++;
+			for (int e = 0; e < ENGINE_COUNT; e++) {
+				if (!strcmp(argv[i], engineNames[e])) onlyEngine = e;
+			}
+			if (onlyEngine == -1) help(1);
+		}
+		else {
+			fileName = argv[i];
+		}
+	}
+
+	if (!fileName) help(1);
+
+	FILE *file = fopen(fileName, "rb");
+	if (!file) {
+		fprintf(stderr, "error: failed to open %s\n", fileName);
+		return EXIT_FAILURE;
+	}
+
+	static u8 rom[0x8001];
+	unsigned int size = fread(rom, 1, sizeof(rom), file);
+	fclose(file);
+
+	VM *vm = vmCreate(&(VMHost) {
+		.draw = render ? onDraw : NULL,
+		.clear = render ? onClear : NULL,
+		.map = render ? onMap : NULL,
+		.sprites = render ? onSprites : NULL,
+		.loadSram = onLoadSram,
+		.error = onError
+	});
+	if (!vm) return EXIT_FAILURE;
+
+	// Only the frame loops (switch, threaded) use superinstructions
+	uint64_t fuseCount[FUSE_COUNT] = {0};
+	uint32_t idleFrames = 0;
+	uint32_t jitBlocks = 0, coldBlocks = 0;
+	uint64_t jitIns = 0, coldRuns = 0, coldIns = 0;
+
+	printf("%-10s %12s %10s %10s  %s\n", "engine", "instructions", "seconds", "MIPS", "state");
+
+	for (int e = ENGINE_STEP; e < ENGINE_COUNT; e++) {
+		if (onlyEngine != -1 && e != onlyEngine) continue;
+
+		// Same random numbers for every engine
+		vm->seed = seed;
+		failed = false;
+		if (!vmLoad(vm, rom, size)) return EXIT_FAILURE;
+		vm->engine = e;
+		vm->jitHot = hot;
+
+		#ifdef RECOMP
+			if (size == recompRomSize && !memcmp(rom, recompRom, size)) vm->native = recompRun;
+		#endif
+		if (e == ENGINE_NATIVE && !vm->native) continue;
+
+		double start = now();
+		for (int f = 0; f < frames && !failed; f++) {
+			if (render && !vm->keepScreen) renderClear(render, vm->reg.clearX, vm->reg.clearY);
+			vmRunFrame(vm);
+		}
+		double time = now() - start;
+
+		printf(
+			"%-10s %12llu %10.3f %10.1f  %016llx\n", engineNames[e],
+			(unsigned long long) vm->insCount, time, vm->insCount / time / 1e6,
+			(unsigned long long) hashState(vm)
+		);
+
+		idleFrames = vm->idleFrames;
+		if (e == ENGINE_JIT) {
+			jitBlocks = vm->jitBlocks;
+			coldBlocks = vm->jitColdBlocks;
+			coldRuns = vm->jitColdRuns;
+			coldIns = vm->jitColdIns;
+			jitIns = vm->insCount - coldIns;
+		}
+		if (e == ENGINE_SWITCH || e == ENGINE_THREADED) {
+			memcpy(fuseCount, vm->fuseCount, sizeof(fuseCount));
+		}
+	}
+
+	if (report) {
+		printf("\n%-10s %12s\n", "fusion", "count");
+		for (int i = 0; i < FUSE_COUNT; i++) {
+			printf("%-10s %12llu\n", fusenames[i], (unsigned long long) fuseCount[i]);
+		}
+		printf("\n%-10s %12u\n", "idle", idleFrames);
+
+		// Blocks that got hot are counted as interpreted too
+		printf("\n%-10s %12s %12s %12s\n", "jit tier", "blocks", "entries", "instructions");
+		printf(
+			"%-10s %12u %12llu %12llu\n", "interp", coldBlocks,
+			(unsigned long long) coldRuns, (unsigned long long) coldIns
+		);
+		printf("%-10s %12u %12s %12llu\n", "native", jitBlocks, "-", (unsigned long long) jitIns);
+	}
+
+	vmDestroy(vm);
+	free(render);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,558 @@
+#include "vm.h"
+
+// _____________________________________________________________________________
+//
+//  gxrecomp: translate a gxarch ROM to C
+// _____________________________________________________________________________
+//
+// Follows the control flow from the entry point. Every CALL target becomes a C
+// function containing all the code reachable from it without calling, with a
+// label for every instruction. See src/recomp.h for how the generated code is
+// run.
+//
+VM *vm;
+FILE *out;
+
+bool isFunc[0x8000];
+u16 funcs[0x8000];
+int funcCount = 0;
+
+// Code of the function being generated
+bool inFunc[CODE_SIZE];
+
+// Function that runs each address, written into the function table
+u16 owner[0x8000];
+bool hasOwner[0x8000];
+
+void addFunc(u16 addr) {
+	if (addr > 0x7FFF || isFunc[addr]) return;
+	isFunc[addr] = true;
+	funcs[funcCount++] = addr;
+}
+
+// Address operand if it's known when recompiling, -1 if it's in registers
+int staticAddr(const Insn *ins, u8 flag) {
+	return (ins->op & flag) ? -1 : ins->addr;
+}
+
+// Find the code of the function starting at start. Any functions it calls are
+// added to the list.
+void findCode(u16 start) {
+	static u16 stack[CODE_SIZE];
+	int top = 0;
+
+	memset(inFunc, 0, sizeof(inFunc));
+	stack[top++] = start;
+	inFunc[start] = true;
+
+	while (top) {
+		u16 addr = stack[--top];
+		const Insn *ins = &vm->code[addr];
+		int jump = -1;
+		bool next = true;
+
+		switch (ins->opcode) {
+			case OP_EQJ: case OP_LTJ: case OP_GTJ:
+				jump = staticAddr(ins, 0b00100000);
+				break;
+
+			case OP_EQC: case OP_LTC: case OP_GTC:
+				if (staticAddr(ins, 0b00100000) >= 0) addFunc(ins->addr);
+				break;
+
+			case OP_JMP:
+				jump = staticAddr(ins, 0b10000000);
+				next = false;
+				break;
+
+			case OP_CJ:
+				jump = staticAddr(ins, 0b01000000);
+				break;
+
+			case OP_CALL: case OP_CALLF:
+				if (staticAddr(ins, 0b10000000) >= 0) addFunc(ins->addr);
+				break;
+
+			case OP_CC:
+				if (staticAddr(ins, 0b01000000) >= 0) addFunc(ins->addr);
+				break;
+
+			case OP_RET: case OP_RETV: case OP_RETF: case H_BADPC: case H_INVALID:
+				next = false;
+				break;
+		}
+
+		if (jump > 0x7FFF) jump = -1;
+		if (jump >= 0 && !inFunc[jump]) {
+			inFunc[jump] = true;
+			stack[top++] = jump;
+		}
+		if (next && ins->next < 0x8000 && !inFunc[ins->next]) {
+			inFunc[ins->next] = true;
+			stack[top++] = ins->next;
+		}
+	}
+}
+
+// _____________________________________________________________________________
+//
+//  Code generation
+// _____________________________________________________________________________
+//
+// The operand strings are only valid until the next call
+#define OPERAND_SIZE 32
+
+// Read a register whose number is known, %62 gets a new random number
+void readReg(char *buf, int reg) {
+	if (reg == 62) snprintf(buf, OPERAND_SIZE, "vmRand(vm)");
+	else snprintf(buf, OPERAND_SIZE, "r[%d]", reg);
+}
+
+// 8-bit operand, see VAL() in interp.h. Returns NULL if it's an invalid
+// register.
+const char *val(const Insn *ins, int n, u8 flag) {
+	static char buf[3][OPERAND_SIZE];
+	u8 arg = ins->arg[n];
+
+	if (!(ins->op & flag)) {
+		snprintf(buf[n], OPERAND_SIZE, "%d", arg);
+	}
+	else if (arg > 63) return NULL;
+	else readReg(buf[n], arg);
+	return buf[n];
+}
+
+// Address operand, see ADDR() in interp.h
+const char *addr(const Insn *ins, u8 flag) {
+	static char buf[OPERAND_SIZE*2 + 16];
+
+	if (ins->op & flag) {
+		char hi[OPERAND_SIZE], lo[OPERAND_SIZE];
+		readReg(hi, ins->addr);
+		readReg(lo, ins->addr + 1);
+		snprintf(buf, sizeof(buf), "(%s << 8 | %s)", hi, lo);
+	}
+	else snprintf(buf, sizeof(buf), "0x%.4X", ins->addr);
+	return buf;
+}
+
+// Store a value into a register operand. Returns false if it's an invalid
+// register.
+bool setReg(u16 pc, const Insn *ins, int n, u8 flag, const char *value) {
+	u8 arg = ins->arg[n];
+	char reg[OPERAND_SIZE];
+
+	if (ins->op & flag) {
+		if (arg > 63) return false;
+		readReg(reg, arg);
+		fprintf(out, "\tSETREG(0x%.4X, %s, %s);\n", pc, reg, value);
+	}
+	else if (arg > 63) return false;
+	else fprintf(out, "\tr[%d] = %s;\n", arg, value);
+	return true;
+}
+
+// Continue at an address in the same function, or leave it
+void jump(const Insn *ins, u8 flag) {
+	if (ins->op & flag) {
+		fprintf(out, "{ pc = %s; goto dispatch; }\n", addr(ins, flag));
+	}
+	else if (ins->addr < 0x8000 && inFunc[ins->addr]) {
+		fprintf(out, "goto L_%.4X;\n", ins->addr);
+	}
+	else fprintf(out, "return 0x%.4X;\n", ins->addr);
+}
+
+void call(const Insn *ins, u8 flag) {
+	const char *enter = (ins->opcode == OP_CALLF) ? "vmCallFast" : "vmCall";
+
+	if (ins->op & flag) {
+		fprintf(out, "CALLPTR(%s, %s, 0x%.4X)\n", enter, addr(ins, flag), ins->next);
+	}
+	else if (ins->addr < 0x8000 && ins->next < 0x8000) {
+		fprintf(
+			out, "CALL(%s, 0x%.4X, f_%.4X, 0x%.4X, L_%.4X)\n",
+			enter, ins->addr, ins->addr, ins->next, ins->next
+		);
+	}
+	else {
+		fprintf(
+			out, "{ vm->pc = 0x%.4X; %s(vm, 0x%.4X); return 0x%.4X; }\n",
+			ins->next, enter, ins->addr, ins->addr
+		);
+	}
+}
+
+// Generate one instruction. Returns false if it always causes an error.
+bool genInsn(u16 pc, const Insn *ins) {
+	const char *a, *b;
+	char expr[128];
+
+	#define VAL(var, n, flag) if (!(var = val(ins, n, flag))) return false;
+
+	switch (ins->opcode) {
+		case OP_NOP:
+			return true;
+
+		case OP_SET:
+			VAL(a, 1, 0b01000000);
+			return setReg(pc, ins, 0, 0b10000000, a);
+
+		case OP_LD:
+			if (ins->arg[0] > 63) return false;
+			if (ins->op & 0b01000000) {
+				fprintf(out, "\t{\n\tu16 a = %s;\n", addr(ins, 0b01000000));
+				fprintf(out, "\tif (a > 0x7FFF && a < 0xE000) FAIL(0x%.4X);\n", pc);
+				setReg(pc, ins, 0, 0b10000000, "vm->mem[a]");
+				fputs("\t}\n", out);
+				return true;
+			}
+			if (ins->addr > 0x7FFF && ins->addr < 0xE000) return false;
+			snprintf(expr, sizeof(expr), "vm->mem[0x%.4X]", ins->addr);
+			return setReg(pc, ins, 0, 0b10000000, expr);
+
+		case OP_ST: {
+			u8 arg = ins->arg[0];
+			if (arg > 63) return false;
+			if (!(ins->op & 0b01000000) && ins->addr < 0xE000) return false;
+
+			char reg[OPERAND_SIZE];
+			readReg(reg, arg);
+			fprintf(out, "\t{\n\tu16 a = %s;\n", addr(ins, 0b01000000));
+			if (ins->op & 0b01000000) fprintf(out, "\tif (a < 0xE000) FAIL(0x%.4X);\n", pc);
+
+			if (ins->op & 0b10000000) {
+				fprintf(out, "\tu8 reg = %s;\n\tif (reg > 63) FAIL(0x%.4X);\n", reg, pc);
+				fputs("\tvm->mem[a] = READ(reg);\n\t}\n", out);
+			}
+			else fprintf(out, "\tvm->mem[a] = %s;\n\t}\n", reg);
+			return true;
+		}
+
+		case OP_LDX: case OP_STX: {
+			u8 arg = ins->arg[0];
+			if (arg > 63 || ins->arg[1] > 63) return false;
+
+			char reg[OPERAND_SIZE];
+			readReg(reg, ins->arg[1]);
+			fprintf(out, "\t{\n\tu8 o = %s;\n", reg);
+			fprintf(out, "\tu16 a = (u16) (%s + o);\n", addr(ins, 0b01000000));
+
+			if (ins->opcode == OP_LDX) {
+				fprintf(out, "\tif (a > 0x7FFF && a < 0xE000) FAIL(0x%.4X);\n", pc);
+				setReg(pc, ins, 0, 0b10000000, "vm->mem[a]");
+			} else {
+				fprintf(out, "\tif (a < 0xE000) FAIL(0x%.4X);\n", pc);
+				readReg(reg, arg);
+				if (ins->op & 0b10000000) {
+					fprintf(out, "\tu8 reg = %s;\n\tif (reg > 63) FAIL(0x%.4X);\n", reg, pc);
+					fputs("\tvm->mem[a] = READ(reg);\n", out);
+				}
+				else fprintf(out, "\tvm->mem[a] = %s;\n", reg);
+			}
+
+			if (ins->op & 0b00100000) fprintf(out, "\tr[%d] = o + 1;\n", ins->arg[1]);
+			fputs("\t}\n", out);
+			return true;
+		}
+
+		case OP_ADD: case OP_SUB: case OP_MUL: {
+			const char *sign = ins->opcode == OP_ADD ? "+" : ins->opcode == OP_SUB ? "-" : "*";
+			VAL(a, 0, 0b10000000);
+			VAL(b, 1, 0b01000000);
+			if (ins->arg[2] > 63) return false;
+
+			fprintf(out, "\t{\n\tu16 result = %s %s %s;\n", a, sign, b);
+			setReg(pc, ins, 2, 0b00100000, "result & 0xFF");
+			fputs("\tr[63] = result >> 8;\n\t}\n", out);
+			return true;
+		}
+
+		case OP_SHL: case OP_SHR: case OP_ROL: case OP_ROR: {
+			static const char *names[] = {"OP_SHL", "OP_SHR", "OP_ROL", "OP_ROR"};
+			VAL(a, 0, 0b10000000);
+			VAL(b, 1, 0b01000000);
+			if (ins->arg[2] > 63) return false;
+
+			fprintf(out, "\t{\n\tu16 result = vmShift(%s, %s, %s);\n", names[ins->opcode - OP_SHL], a, b);
+			setReg(pc, ins, 2, 0b00100000, "result & 0xFF");
+			fputs("\tr[63] = result >> 8;\n\t}\n", out);
+			return true;
+		}
+
+		case OP_DIV: case OP_MOD:
+			VAL(a, 0, 0b10000000);
+			VAL(b, 1, 0b01000000);
+			if (!(ins->op & 0b01000000) && !ins->arg[1]) return false;
+			if (ins->op & 0b01000000) fprintf(out, "\tif (!%s) FAIL(0x%.4X);\n", b, pc);
+
+			snprintf(expr, sizeof(expr), "%s %s %s", a, ins->opcode == OP_DIV ? "/" : "%", b);
+			return setReg(pc, ins, 2, 0b00100000, expr);
+
+		case OP_AND: case OP_OR: case OP_XOR:
+		case OP_EQ: case OP_LT: case OP_GT: {
+			static const char *signs[] = {"&", "|", "^", "==", "<", ">"};
+			VAL(a, 0, 0b10000000);
+			VAL(b, 1, 0b01000000);
+
+			snprintf(expr, sizeof(expr), "%s %s %s", a, signs[ins->opcode - OP_AND], b);
+			return setReg(pc, ins, 2, 0b00100000, expr);
+		}
+
+		case OP_EQJ: case OP_LTJ: case OP_GTJ:
+		case OP_EQC: case OP_LTC: case OP_GTC: {
+			static const char *signs[] = {"==", "<", ">"};
+			const char *sign = signs[(ins->opcode - OP_EQJ) % 3];
+			VAL(a, 0, 0b10000000);
+			VAL(b, 1, 0b01000000);
+
+			fprintf(out, "\tif (%s %s %s) ", a, sign, b);
+			if (ins->opcode <= OP_GTJ) jump(ins, 0b00100000);
+			else call(ins, 0b00100000);
+			return true;
+		}
+
+		case OP_ARG:
+			VAL(a, 0, 0b10000000);
+			fprintf(out, "\tif (vm->argsp > 7) FAIL(0x%.4X);\n", pc);
+			fprintf(out, "\tvm->frames[vm->sp].args[vm->argsp++] = %s;\n", a);
+			return true;
+
+		case OP_ARGN: {
+			int count = ins->arg[0];
+			fprintf(out, "\tif (vm->argsp > %d) FAIL(0x%.4X);\n", 8 - count, pc);
+			fputs("\t{\n\t\tu8 *a = &vm->frames[vm->sp].args[vm->argsp];\n", out);
+
+			for (int i = 0; i < count; i++) {
+				char reg[OPERAND_SIZE];
+				u8 v = vm->mem[ins->addr + i];
+
+				if (ins->arg[1] & (0b10000000 >> i)) readReg(reg, v);
+				else snprintf(reg, OPERAND_SIZE, "%d", v);
+				fprintf(out, "\t\ta[%d] = %s;\n", i, reg);
+			}
+			fprintf(out, "\t\tvm->argsp += %d;\n\t}\n", count);
+			return true;
+		}
+
+		case OP_JMP:
+			fputc('\t', out);
+			jump(ins, 0b10000000);
+			return true;
+
+		case OP_CJ: case OP_CC:
+			if (ins->arg[0] > 63) return false;
+			if (ins->op & 0b10000000) {
+				// Not %62, that's left to the interpreter
+				fprintf(out, "\tif (r[%d] > 63) FAIL(0x%.4X);\n", ins->arg[0], pc);
+				fprintf(out, "\tif (READ(r[%d])) ", ins->arg[0]);
+			}
+			else {
+				char reg[OPERAND_SIZE];
+				readReg(reg, ins->arg[0]);
+				fprintf(out, "\tif (%s) ", reg);
+			}
+
+			if (ins->opcode == OP_CJ) jump(ins, 0b01000000);
+			else call(ins, 0b01000000);
+			return true;
+
+		case OP_CALL: case OP_CALLF:
+			fputc('\t', out);
+			call(ins, 0b10000000);
+			return true;
+
+		case OP_RET:
+			fputs("\tRETURN(vmReturn);\n", out);
+			return true;
+
+		case OP_RETF:
+			fputs("\tRETURN(vmReturnFast);\n", out);
+			return true;
+
+		case OP_RETV:
+			VAL(a, 0, 0b10000000);
+			fprintf(out, "\tr[48] = %s;\n\tRETURN(vmReturn);\n", a);
+			return true;
+
+		case OP_SYS:
+			VAL(a, 0, 0b10000000);
+			fprintf(out, "\tSYS(0x%.4X, %s, 0x%.4X);\n", pc, a, ins->next);
+			return true;
+
+		default:
+			return false;
+	}
+
+	#undef VAL
+}
+
+// Does the instruction jump to an address in registers
+bool isJumpPtr(const Insn *ins) {
+	switch (ins->opcode) {
+		case OP_EQJ: case OP_LTJ: case OP_GTJ: return ins->op & 0b00100000;
+		case OP_JMP: return ins->op & 0b10000000;
+		case OP_CJ: return ins->op & 0b01000000;
+		default: return false;
+	}
+}
+
+void genFunc(u16 start) {
+	findCode(start);
+
+	// Jumps to addresses in registers go back to the switch
+	bool hasJumpPtr = false;
+	for (int i = 0; i < 0x8000; i++) {
+		if (inFunc[i] && isJumpPtr(&vm->code[i])) hasJumpPtr = true;
+	}
+
+	fprintf(out, "static u16 f_%.4X(VM *vm, u16 pc, RecompCtx *c) {\n", start);
+	fputs("\tu8 *r = vm->reg.data;\n\n", out);
+	if (hasJumpPtr) fputs("dispatch:\n", out);
+	fputs("\tswitch (pc) {\n", out);
+	for (int i = 0; i < 0x8000; i++) {
+		if (inFunc[i]) fprintf(out, "\t\tcase 0x%.4X: goto L_%.4X;\n", i, i);
+	}
+	fputs("\t\tdefault: return pc;\n\t}\n", out);
+
+	int prev = -1;
+	for (int i = 0; i < 0x8000; i++) {
+		if (!inFunc[i]) continue;
+		const Insn *ins = &vm->code[i];
+
+		// Fall through to the next instruction if it comes right after this one
+		// in the generated code
+		if (prev >= 0) {
+			u16 next = vm->code[prev].next;
+			if (next != i) {
+				if (next < 0x8000 && inFunc[next]) fprintf(out, "\tgoto L_%.4X;\n", next);
+				else fprintf(out, "\treturn 0x%.4X;\n", next);
+			}
+		}
+		prev = -1;
+
+		fprintf(out, "\nL_%.4X:", i);
+		if (ins->opcode < OP_COUNT) {
+			// The names are padded with spaces
+			fprintf(out, "  // %.*s", (int) strcspn(opnames[ins->opcode], " "), opnames[ins->opcode]);
+		}
+		// The order C reads the operands in isn't fixed, so instructions that
+		// can read the rand register more than once are interpreted
+		bool dynamic;
+		int randReads = vmRandReads(vm, ins, &dynamic);
+		fprintf(out, "\n\t%s(0x%.4X);\n", (randReads || dynamic) ? "STEPR" : "STEP", i);
+
+		if (!hasOwner[i] || i == start) {
+			hasOwner[i] = true;
+			owner[i] = start;
+		}
+
+		// The end of an idle loop is interpreted too, it can end the frame.
+		// Instructions that failed vmDecode()'s checks are left to
+		// vmExecute(), which reports the error.
+		if (
+			randReads > 1 || (randReads && dynamic) || ins->handler == H_IDLE ||
+			ins->handler == H_UNVERIFIED || !genInsn(i, ins)
+		) {
+			fprintf(out, "\tFAIL(0x%.4X);\n", i);
+			continue;
+		}
+
+		switch (ins->opcode) {
+			case OP_JMP: case OP_RET: case OP_RETV: case OP_RETF: break;
+			default: prev = i; break;
+		}
+	}
+
+	if (prev >= 0) fprintf(out, "\treturn 0x%.4X;\n", vm->code[prev].next);
+	fputs("}\n\n", out);
+}
+
+void help(int exitcode) {
+	puts("gxrecomp: translate a gxarch ROM to C\n");
+	puts("Usage: gxrecomp file [output]");
+	puts("-h, --help         Show this message\n");
+	puts("The output defaults to the ROM's name with .c as the extension. Build it");
+	puts("into gxVM with RECOMP=file.c ./build.sh, it's used when that ROM is loaded.");
+	exit(exitcode);
+}
+
+int main(int argc, char **argv) {
+	char *fileName = NULL;
+	char *outName = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) help(0);
+		else if (!fileName) fileName = argv[i];
+		else outName = argv[i];
+	}
+
+	if (!fileName) help(1);
+
+	FILE *file = fopen(fileName, "rb");
+	if (!file) {
+		fprintf(stderr, "error: failed to open %s\n", fileName);
+		return EXIT_FAILURE;
+	}
+
+	static u8 rom[0x8001];
+	unsigned int size = fread(rom, 1, sizeof(rom), file);
+	fclose(file);
+
+	vm = vmCreate(&(VMHost) {0});
+	if (!vm) return EXIT_FAILURE;
+	if (!vmLoad(vm, rom, size)) {
+		fprintf(stderr, "error: %s is not a valid gxarch ROM\n", fileName);
+		return EXIT_FAILURE;
+	}
+
+	char defaultName[256];
+	if (!outName) {
+		snprintf(defaultName, sizeof(defaultName) - 2, "%s", fileName);
+		char *ext = strrchr(defaultName, '.');
+		if (ext && !strchr(ext, '/')) *ext = '\0';
+		strcat(defaultName, ".c");
+		outName = defaultName;
+	}
+
+	out = fopen(outName, "w");
+	if (!out) {
+		fprintf(stderr, "error: failed to open %s\n", outName);
+		return EXIT_FAILURE;
+	}
+
+	// Find every function first so they can be declared
+	addFunc(vm->pc);
+	for (int i = 0; i < funcCount; i++) findCode(funcs[i]);
+
+	fprintf(out, "// Generated by gxrecomp from %s, don't edit\n", fileName);
+	fputs("#include \"recomp.h\"\n\n", out);
+
+	for (int i = 0; i < funcCount; i++) {
+		fprintf(out, "static u16 f_%.4X(VM *vm, u16 pc, RecompCtx *c);\n", funcs[i]);
+	}
+	fputc('\n', out);
+
+	for (int i = 0; i < funcCount; i++) genFunc(funcs[i]);
+
+	fputs("static const RecompFunc funcs[0x8000] = {\n", out);
+	for (int i = 0; i < 0x8000; i++) {
+		if (hasOwner[i]) fprintf(out, "\t[0x%.4X] = f_%.4X,\n", i, owner[i]);
+	}
+	fputs("};\n\n", out);
+
+	fputs("const u8 recompRom[] = {", out);
+	for (unsigned int i = 0; i < size; i++) {
+		fprintf(out, "%s0x%.2X,", (i % 16) ? " " : "\n\t", rom[i]);
+	}
+	fputs("\n};\n", out);
+	fprintf(out, "const unsigned int recompRomSize = %u;\n\n", size);
+
+	fputs("RunResult recompRun(VM *vm, uint64_t budget) {\n", out);
+	fputs("\treturn recompRunFrame(vm, budget, funcs);\n}\n", out);
+
+	fclose(out);
+	printf("%s: %d functions\n", outName, funcCount);
+	vmDestroy(vm);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,126 @@
+#include "vm.h"
+
+// _____________________________________________________________________________
+//
+//  gxtrace: convert a gxVM trace file (gxvm --trace) to text
+// _____________________________________________________________________________
+//
+// Print one record in the same format as the old gxVM debug log.
+void printRecord(const TraceRecord *rec, FILE *out) {
+	u8 op = rec->opcode;
+
+	if (op >= OP_COUNT) {
+		fprintf(out, "0x%.4X  ??? %.2X\n", rec->pc, rec->op);
+		return;
+	}
+
+	fprintf(out, "0x%.4X  %s", rec->pc, opnames[op]);
+
+	if (op == OP_ARGN) {
+		for (int i = 0; i < (rec->op >> 5) + 1; i++) {
+			if (rec->addrArg & (0b10000000 >> i)) {
+				fprintf(out, "[%.2X]->%.2X ", rec->arg[i], rec->res[i]);
+			} else {
+				fprintf(out, "%.2X ", rec->arg[i]);
+			}
+		}
+		fputc('\n', out);
+		return;
+	}
+
+	int flag = 0;
+	int argn = 0;
+
+	for (const char *f = opformats[op]; *f; f++) {
+		switch (*f) {
+			case 'c':
+				// The condition's value is printed like a value operand
+				fprintf(out, "[%.2X]->", rec->arg[argn++]);
+				// fall through
+
+			case 'v':
+				if (rec->op & (0b10000000 >> flag++)) {
+					fprintf(out, "[%.2X]->%.2X ", rec->arg[argn], rec->res[argn]);
+				} else {
+					fprintf(out, "%.2X ", rec->arg[argn]);
+				}
+				argn++;
+				break;
+
+			case 'a':
+				if (rec->op & (0b10000000 >> flag++)) {
+					fprintf(out, "[%.2X]->%.4X ", rec->addrArg, rec->addr);
+				} else {
+					fprintf(out, "%.4X ", rec->addr);
+				}
+				break;
+
+			case 'o':
+				fprintf(out, "+[%.2X]->%.2X", rec->arg[argn], rec->res[argn]);
+				if (rec->op & (0b10000000 >> flag++)) fputs("++", out);
+				fputc(' ', out);
+				argn++;
+				break;
+		}
+	}
+
+	if (op == OP_SYS && rec->res[0] < SYS_COUNT) fputs(sysnames[rec->res[0]], out);
+	fputc('\n', out);
+
+	if (op == OP_SYS && rec->res[0] == SYS_END) {
+		fputs("_________________________________________________________________________\n\n", out);
+	}
+}
+
+void help(int exitcode) {
+	puts("gxtrace: gxVM trace decoder\n");
+	puts("Usage: gxtrace [options] file");
+	puts("-h, --help         Show this message");
+	puts("-f, --frame N      Only show frame N");
+	exit(exitcode);
+}
+
+int main(int argc, char **argv) {
+	char *fileName = NULL;
+	long onlyFrame = -1;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
+			help(0);
+		}
+		else if ((!strcmp(argv[i], "--frame") || !strcmp(argv[i], "-f")) && i + 1 < argc) {
+			onlyFrame = strtol(argv[++i], NULL, 0);
+		}
+		else {
+			fileName = argv[i];
+		}
+	}
+
+	if (!fileName) help(1);
+
+	FILE *file = fopen(fileName, "rb");
+	if (!file) {
+		fprintf(stderr, "error: failed to open %s\n", fileName);
+		return EXIT_FAILURE;
+	}
+
+	char magic[4];
+	if (fread(magic, 1, 4, file) != 4 || memcmp(magic, TRACE_MAGIC, 4)) {
+		fprintf(stderr, "error: %s is not a gxVM trace file\n", fileName);
+		fclose(file);
+		return EXIT_FAILURE;
+	}
+
+	TraceRecord recs[TRACE_BUFLEN];
+	size_t count;
+
+	while ((count = fread(recs, sizeof(TraceRecord), TRACE_BUFLEN, file))) {
+		for (size_t i = 0; i < count; i++) {
+			if (onlyFrame >= 0 && recs[i].frame != onlyFrame) continue;
+			printRecord(&recs[i], stdout);
+		}
+	}
+
+	fclose(file);
+	return EXIT_SUCCESS;
+}